@@ -0,0 +1,125 @@
+/*
+ * Port of the cache-thrash benchmark from Hoard (Berger et al., "Hoard: A Scalable Memory Allocator for
+ * Multithreaded Applications") to the tralloc benchmark harness.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: cache_thrash [-a allocator] [threads iterations size repetitions]
+ * Defaults: 4 1000 8 10000. The allocator defaults to tralloc-locked.
+ *
+ * Every thread allocates a small object, writes each of its bytes repetitions times, frees it, and starts over, for its
+ * share of iterations. Threads never share objects, but an allocator that hands concurrent threads neighbouring chunks
+ * puts their objects on the same cache line, and the line bounces between cores on every write (active false sharing).
+ * Reports wall-clock time, lower is better.
+ */
+
+#include "harness.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct config {
+    size_t threads;
+    uint64_t iterations;
+    size_t size;
+    uint64_t repetitions;
+} config;
+
+typedef struct worker_arg {
+    const bench_allocator *allocator;
+    const config *cfg;
+} worker_arg;
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx);
+static void *worker(void *arg);
+
+int main(int argc, char **argv) {
+    config cfg = { 4, 1000, 8, 10000 };
+    const bench_allocator *a = &bench_tralloc_locked;
+    int i = 1;
+    if(i + 1 < argc && !strcmp(argv[i], "-a")) {
+        a = bench_find_allocator(argv[i + 1]);
+        i += 2;
+    }
+    if(argc - i == 4) {
+        cfg.threads = strtoull(argv[i], NULL, 10);
+        cfg.iterations = strtoull(argv[i + 1], NULL, 10);
+        cfg.size = strtoull(argv[i + 2], NULL, 10);
+        cfg.repetitions = strtoull(argv[i + 3], NULL, 10);
+    } else if(argc != i) {
+        a = NULL;
+    }
+    if(!a || !cfg.threads || !cfg.iterations || !cfg.size) {
+        fprintf(stderr, "usage: cache_thrash [-a allocator] [threads iterations size repetitions]\n");
+        return 2;
+    }
+    if(a == &bench_tralloc && cfg.threads > 1) {
+        fprintf(stderr, "cache_thrash: tralloc isn't thread-safe, use tralloc-locked\n");
+        return 2;
+    }
+    bench_result result;
+    if(bench_run(run, a, &cfg, false, &result)) {
+        fprintf(stderr, "cache_thrash: run with %s failed\n", a->name);
+        return 1;
+    }
+    printf("%-13s %-14s %3zu threads %10.3f s\n", "cache-thrash", a->name, cfg.threads,
+        (double)result.extra[0] / 1e9);
+    return 0;
+}
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx) {
+    const config *cfg = ctx;
+    pthread_t *threads = bench_map(cfg->threads * sizeof(pthread_t));
+    worker_arg arg = { a, cfg };
+    uint64_t start = bench_now_ns();
+    size_t t;
+    for(t = 0; t < cfg->threads; t++) {
+        if(pthread_create(&threads[t], NULL, worker, &arg)) _exit(1);
+    }
+    for(t = 0; t < cfg->threads; t++) pthread_join(threads[t], NULL);
+    r->extra[0] = bench_now_ns() - start;
+    r->allocs = r->frees = cfg->iterations / cfg->threads * cfg->threads;
+    bench_unmap(threads, cfg->threads * sizeof(pthread_t));
+}
+
+static void *worker(void *arg) {
+    const worker_arg *w = arg;
+    const config *cfg = w->cfg;
+    uint64_t i, j;
+    size_t k;
+    for(i = 0; i < cfg->iterations / cfg->threads; i++) {
+        volatile char *object = w->allocator->alloc(cfg->size);
+        for(j = 0; j < cfg->repetitions; j++) {
+            for(k = 0; k < cfg->size; k++) object[k] = (char)(object[k] + 1);
+        }
+        w->allocator->free((void *)object);
+    }
+    return NULL;
+}
@@ -0,0 +1,207 @@
+/*
+ * Shared plumbing for the tralloc benchmarks.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "harness.h"
+#include "../tralloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+const bench_allocator bench_tralloc = { "tralloc", tralloc, trfree };
+const bench_allocator bench_malloc = { "malloc", malloc, free };
+
+static void *locked_alloc(size_t size);
+static void locked_free(void *ptr);
+
+const bench_allocator bench_tralloc_locked = { "tralloc-locked", locked_alloc, locked_free };
+
+static const bench_allocator *allocators[] = { &bench_tralloc, &bench_malloc, &bench_tralloc_locked };
+static pthread_mutex_t tralloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *map(size_t bytes, int flags);
+static void *idle(void *arg);
+
+int bench_run(bench_fn fn, const bench_allocator *allocator, void *ctx, bool perf, bench_result *out) {
+    int fds[2];
+    if(pipe(fds)) return -1;
+    // Anything buffered now would otherwise be printed twice.
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) return -1;
+    if(!pid) {
+        bench_result result;
+        memset(&result, 0, sizeof(result));
+        close(fds[0]);
+        pthread_t warm_up;
+        if(pthread_create(&warm_up, NULL, idle, NULL) || pthread_join(warm_up, NULL)) _exit(1);
+        if(perf) {
+            perf_counters_open(&result.perf);
+        } else {
+            int i;
+            for(i = 0; i < PERF_COUNTERS; i++) result.perf.fds[i] = -1;
+        }
+        fn(allocator, &result, ctx);
+        perf_counters_read(&result.perf);
+        result.heap_bytes = bench_heap_bytes(allocator);
+        bool sent = write(fds[1], &result, sizeof(result)) == sizeof(result);
+        perf_counters_close(&result.perf);
+        _exit(sent ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return n == sizeof(*out) && WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+const bench_allocator *bench_find_allocator(const char *name) {
+    return bench_find_allocator_in(name, allocators, sizeof(allocators) / sizeof(allocators[0]));
+}
+
+const bench_allocator *bench_find_allocator_in(const char *name, const bench_allocator *const *list, size_t count) {
+    size_t i;
+    for(i = 0; i < count; i++) {
+        if(!strcmp(list[i]->name, name)) return list[i];
+    }
+    return NULL;
+}
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_timer_start(bench_result *result) {
+    perf_counters_resume(&result->perf);
+    return bench_now_ns();
+}
+
+uint64_t bench_timer_stop(bench_result *result, uint64_t start) {
+    uint64_t elapsed = bench_now_ns() - start;
+    perf_counters_pause(&result->perf);
+    return elapsed;
+}
+
+void *bench_map(size_t bytes) { return map(bytes, MAP_PRIVATE); }
+
+void *bench_map_shared(size_t bytes) { return map(bytes, MAP_SHARED); }
+
+void bench_unmap(void *ptr, size_t bytes) { munmap(ptr, bytes); }
+
+static void *idle(void *arg) { return arg; }
+
+static void *map(size_t bytes, int flags) {
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+uint64_t bench_rand(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+double bench_uniform(uint64_t *state) { return (double)(bench_rand(state) >> 11) / 9007199254740992.0; }
+
+void bench_live_push(bench_object *live, size_t *count, bench_object o) {
+    size_t i = (*count)++;
+    while(i) {
+        size_t parent = (i - 1) / 2;
+        if(live[parent].death <= o.death) break;
+        live[i] = live[parent];
+        i = parent;
+    }
+    live[i] = o;
+}
+
+bench_object bench_live_pop(bench_object *live, size_t *count) {
+    bench_object top = live[0];
+    bench_object last = live[--*count];
+    size_t i = 0;
+    for(;;) {
+        size_t child = 2 * i + 1;
+        if(child >= *count) break;
+        if(child + 1 < *count && live[child + 1].death < live[child].death) child++;
+        if(last.death <= live[child].death) break;
+        live[i] = live[child];
+        i = child;
+    }
+    live[i] = last;
+    return top;
+}
+
+uint64_t bench_heap_bytes(const bench_allocator *allocator) {
+    if(bench_is_tralloc(allocator)) {
+        struct trstats stats;
+        trstats(&stats);
+        return stats.heap_size;
+    }
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+bool bench_is_tralloc(const bench_allocator *allocator) {
+    return allocator == &bench_tralloc || allocator == &bench_tralloc_locked;
+}
+
+void bench_print(const char *name, const bench_allocator *allocator, const bench_result *result, bool perf) {
+    double alloc_ns = result->allocs ? (double)result->alloc_ns / (double)result->allocs : 0.0;
+    double free_ns = result->frees ? (double)result->free_ns / (double)result->frees : 0.0;
+    printf("%-14s %-8s alloc %12.0f ops/s %8.1f ns/op   free %12.0f ops/s %8.1f ns/op   heap %10llu",
+        name, allocator->name, alloc_ns ? 1e9 / alloc_ns : 0.0, alloc_ns, free_ns ? 1e9 / free_ns : 0.0, free_ns,
+        (unsigned long long)result->heap_bytes);
+    if(perf) perf_counters_print(stdout, &result->perf, result->allocs + result->frees);
+    else printf("\n");
+}
+
+static void *locked_alloc(size_t size) {
+    pthread_mutex_lock(&tralloc_lock);
+    void *ptr = tralloc(size);
+    pthread_mutex_unlock(&tralloc_lock);
+    return ptr;
+}
+
+static void locked_free(void *ptr) {
+    pthread_mutex_lock(&tralloc_lock);
+    trfree(ptr);
+    pthread_mutex_unlock(&tralloc_lock);
+}
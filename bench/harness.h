@@ -0,0 +1,114 @@
+/*
+ * Shared plumbing for the tralloc benchmarks.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Every benchmark case runs in a forked child, for two reasons. Each case starts from a fresh heap, so one case's
+ * fragmentation doesn't leak into the next. And only one allocator ever touches the program break in a process:
+ * glibc's malloc also calls brk, which would break tralloc's assumption that its sbrk calls are contiguous. For the same
+ * reason a case must get its own bookkeeping memory from bench_map, never from malloc, and must not print.
+ * Starting a thread calls malloc inside glibc, and the first such call sets up glibc's heap with brk. The child starts
+ * and joins one thread before the case runs, so that happens before tralloc's first sbrk. Later threads reuse what
+ * glibc already holds, but a case that keeps a great many threads alive at once could in principle move the break.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "perf_counters.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct bench_allocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+} bench_allocator;
+
+extern const bench_allocator bench_tralloc;
+extern const bench_allocator bench_malloc;
+// tralloc and trfree behind a single mutex. tralloc isn't thread-safe, so this is what multi-threaded benchmarks run.
+extern const bench_allocator bench_tralloc_locked;
+
+typedef struct bench_result {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t alloc_ns;
+    uint64_t free_ns;
+    // Heap size when the case finished, as the allocator reports it.
+    uint64_t heap_bytes;
+    // Whatever else a benchmark wants to hand back from the child.
+    uint64_t extra[8];
+    perf_counters perf;
+} bench_result;
+
+typedef void (*bench_fn)(const bench_allocator *allocator, bench_result *result, void *ctx);
+
+// Runs fn in a forked child and copies its result back. With perf set, hardware counters cover the regions the case
+// times with bench_timer_start and bench_timer_stop.
+// Returns 0 on success, or -1 if the child could not be started or died.
+int bench_run(bench_fn fn, const bench_allocator *allocator, void *ctx, bool perf, bench_result *out);
+
+// Finds an allocator by name, or NULL.
+const bench_allocator *bench_find_allocator(const char *name);
+// Like bench_find_allocator, but only among the count allocators in list, for benches that don't run all of them.
+const bench_allocator *bench_find_allocator_in(const char *name, const bench_allocator *const *list, size_t count);
+uint64_t bench_now_ns(void);
+// Bracket a timed region: bench_timer_stop returns the nanoseconds since start. The perf counters run only in between,
+// and are resumed before the clock starts and paused after it stops, so their ioctls aren't part of the time.
+uint64_t bench_timer_start(bench_result *result);
+uint64_t bench_timer_stop(bench_result *result, uint64_t start);
+// Anonymous memory straight from the OS. Exits on failure.
+void *bench_map(size_t bytes);
+// Like bench_map, but shared with forked children, so a case can hand back more than fits in bench_result.
+void *bench_map_shared(size_t bytes);
+void bench_unmap(void *ptr, size_t bytes);
+// xorshift64. state must not be 0.
+uint64_t bench_rand(uint64_t *state);
+// Uniform in [0, 1), from bench_rand.
+double bench_uniform(uint64_t *state);
+
+// A live allocation and the time it is due to be freed, in whatever unit the benchmark counts.
+typedef struct bench_object {
+    uint64_t death;
+    void *ptr;
+    size_t size;
+} bench_object;
+
+// A min-heap of live objects ordered by death, so a benchmark can free whatever has expired. count is the number of
+// objects in live, which must have room for one more on push.
+void bench_live_push(bench_object *live, size_t *count, bench_object o);
+bench_object bench_live_pop(bench_object *live, size_t *count);
+uint64_t bench_heap_bytes(const bench_allocator *allocator);
+// True for either of the tralloc allocators.
+bool bench_is_tralloc(const bench_allocator *allocator);
+// Prints "name allocator: ..." with ops/sec and ns/op for allocs and frees, and perf counters if they were on.
+void bench_print(const char *name, const bench_allocator *allocator, const bench_result *result, bool perf);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Port of the larson server benchmark (Larson and Krishnan, "Memory allocation for long-running server
+ * applications") to the tralloc benchmark harness.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: larson [-a allocator] [seconds min_size max_size blocks_per_thread rounds seed threads]
+ * Defaults: 2 8 1000 5000 100 4141 4. The allocator defaults to tralloc-locked.
+ *
+ * Each thread owns an array of blocks, and repeatedly frees a random one and replaces it with a block of random size.
+ * After every few rounds a thread hands its array to a new thread and exits. The blocks it allocated are then freed by
+ * its successor, the way a server's worker threads free each other's requests. The main thread allocates the first
+ * arrays, so even the first frees cross threads. Throughput is allocations plus frees per second.
+ */
+
+#include "harness.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct config {
+    uint64_t seconds;
+    size_t min_size;
+    size_t max_size;
+    size_t blocks;
+    uint64_t rounds;
+    uint64_t seed;
+    size_t threads;
+} config;
+
+typedef struct slot {
+    const bench_allocator *allocator;
+    const config *cfg;
+    void **blocks;
+    uint64_t rng;
+} slot;
+
+static bool stop;
+static size_t active;
+static uint64_t total_ops;
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx);
+// Runs rounds replacements over its slot, then hands the slot to a new thread, until stop is set.
+static void *worker(void *arg);
+static bool start_worker(slot *s);
+static inline size_t block_size(const config *cfg, uint64_t *rng);
+
+int main(int argc, char **argv) {
+    config cfg = { 2, 8, 1000, 5000, 100, 4141, 4 };
+    const bench_allocator *a = &bench_tralloc_locked;
+    int i = 1;
+    if(i + 1 < argc && !strcmp(argv[i], "-a")) {
+        a = bench_find_allocator(argv[i + 1]);
+        i += 2;
+    }
+    if(argc - i == 7) {
+        cfg.seconds = strtoull(argv[i], NULL, 10);
+        cfg.min_size = strtoull(argv[i + 1], NULL, 10);
+        cfg.max_size = strtoull(argv[i + 2], NULL, 10);
+        cfg.blocks = strtoull(argv[i + 3], NULL, 10);
+        cfg.rounds = strtoull(argv[i + 4], NULL, 10);
+        cfg.seed = strtoull(argv[i + 5], NULL, 10);
+        cfg.threads = strtoull(argv[i + 6], NULL, 10);
+    } else if(argc != i) {
+        a = NULL;
+    }
+    if(!a || !cfg.seconds || !cfg.min_size || cfg.max_size < cfg.min_size || !cfg.blocks || !cfg.rounds || !cfg.seed
+        || !cfg.threads) {
+        fprintf(stderr, "usage: larson [-a allocator] [seconds min_size max_size blocks_per_thread rounds seed threads]\n");
+        return 2;
+    }
+    if(a == &bench_tralloc && cfg.threads > 1) {
+        fprintf(stderr, "larson: tralloc isn't thread-safe, use tralloc-locked\n");
+        return 2;
+    }
+    bench_result result;
+    if(bench_run(run, a, &cfg, false, &result)) {
+        fprintf(stderr, "larson: run with %s failed\n", a->name);
+        return 1;
+    }
+    double seconds = (double)result.extra[0] / 1e9;
+    printf("%-13s %-14s %3zu threads %14.0f ops/s   heap %10llu\n", "larson", a->name, cfg.threads,
+        (double)(result.allocs + result.frees) / seconds, (unsigned long long)result.heap_bytes);
+    return 0;
+}
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx) {
+    const config *cfg = ctx;
+    slot *slots = bench_map(cfg->threads * sizeof(slot));
+    size_t t, i;
+    for(t = 0; t < cfg->threads; t++) {
+        slots[t].allocator = a;
+        slots[t].cfg = cfg;
+        slots[t].blocks = bench_map(cfg->blocks * sizeof(void *));
+        slots[t].rng = cfg->seed + t;
+        for(i = 0; i < cfg->blocks; i++) slots[t].blocks[i] = a->alloc(block_size(cfg, &slots[t].rng));
+    }
+    uint64_t start = bench_now_ns();
+    for(t = 0; t < cfg->threads; t++) {
+        if(!start_worker(&slots[t])) _exit(1);
+    }
+    sleep(cfg->seconds);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    while(__atomic_load_n(&active, __ATOMIC_ACQUIRE)) usleep(1000);
+    r->extra[0] = bench_now_ns() - start;
+    r->allocs = r->frees = __atomic_load_n(&total_ops, __ATOMIC_RELAXED);
+    for(t = 0; t < cfg->threads; t++) {
+        for(i = 0; i < cfg->blocks; i++) a->free(slots[t].blocks[i]);
+        bench_unmap(slots[t].blocks, cfg->blocks * sizeof(void *));
+    }
+    bench_unmap(slots, cfg->threads * sizeof(slot));
+}
+
+static void *worker(void *arg) {
+    slot *s = arg;
+    const config *cfg = s->cfg;
+    uint64_t round;
+    for(round = 0; round < cfg->rounds; round++) {
+        size_t victim = bench_rand(&s->rng) % cfg->blocks;
+        s->allocator->free(s->blocks[victim]);
+        s->blocks[victim] = s->allocator->alloc(block_size(cfg, &s->rng));
+        memset(s->blocks[victim], 0, cfg->min_size);
+    }
+    __atomic_add_fetch(&total_ops, cfg->rounds, __ATOMIC_RELAXED);
+    // The successor is counted before this thread stops counting, so active never drops to 0 early. If it can't be
+    // started, the main thread still frees the slot's blocks.
+    if(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) start_worker(s);
+    __atomic_sub_fetch(&active, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static bool start_worker(slot *s) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    __atomic_add_fetch(&active, 1, __ATOMIC_RELAXED);
+    bool started = !pthread_create(&thread, &attr, worker, s);
+    if(!started) __atomic_sub_fetch(&active, 1, __ATOMIC_RELAXED);
+    pthread_attr_destroy(&attr);
+    return started;
+}
+
+static inline size_t block_size(const config *cfg, uint64_t *rng) {
+    return cfg->min_size + bench_rand(rng) % (cfg->max_size - cfg->min_size + 1);
+}
@@ -0,0 +1,109 @@
+/*
+ * Hardware performance counters for the tralloc benchmarks.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "perf_counters.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const char *names[PERF_COUNTERS] = { "cache-misses", "dTLB-misses", "instructions", "branch-misses" };
+
+static int open_counter(uint32_t type, uint64_t config);
+
+int perf_counters_open(perf_counters *pc) {
+    int opened = 0, i;
+    pc->fds[PERF_CACHE_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    pc->fds[PERF_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    pc->fds[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    pc->fds[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    for(i = 0; i < PERF_COUNTERS; i++) {
+        pc->values[i] = 0;
+        if(pc->fds[i] >= 0) opened++;
+    }
+    return opened;
+}
+
+void perf_counters_resume(perf_counters *pc) {
+    int i;
+    for(i = 0; i < PERF_COUNTERS; i++) {
+        if(pc->fds[i] >= 0) ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_counters_pause(perf_counters *pc) {
+    int i;
+    for(i = 0; i < PERF_COUNTERS; i++) {
+        if(pc->fds[i] >= 0) ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+void perf_counters_read(perf_counters *pc) {
+    int i;
+    for(i = 0; i < PERF_COUNTERS; i++) {
+        // value, time enabled, time running
+        uint64_t data[3];
+        pc->values[i] = 0;
+        if(pc->fds[i] < 0 || read(pc->fds[i], data, sizeof(data)) != sizeof(data)) continue;
+        if(data[2] && data[2] < data[1]) pc->values[i] = (uint64_t)((double)data[0] * ((double)data[1] / (double)data[2]));
+        else pc->values[i] = data[0];
+    }
+}
+
+void perf_counters_close(perf_counters *pc) {
+    int i;
+    for(i = 0; i < PERF_COUNTERS; i++) {
+        if(pc->fds[i] >= 0) close(pc->fds[i]);
+        pc->fds[i] = -1;
+    }
+}
+
+void perf_counters_print(FILE *f, const perf_counters *pc, uint64_t ops) {
+    int i;
+    for(i = 0; i < PERF_COUNTERS; i++) {
+        if(pc->fds[i] < 0) fprintf(f, " %s/op=n/a", names[i]);
+        else fprintf(f, " %s/op=%.3f", names[i], ops ? (double)pc->values[i] / (double)ops : 0.0);
+    }
+    fprintf(f, "\n");
+}
+
+static int open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
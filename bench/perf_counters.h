@@ -0,0 +1,69 @@
+/*
+ * Hardware performance counters for the tralloc benchmarks.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reads cache misses, dTLB misses, instructions and branch misses for the calling thread through perf_event_open, so a
+ * benchmark can report them per operation next to wall time. Counters the kernel or hardware won't provide (containers,
+ * VMs, a restrictive perf_event_paranoid) are simply reported as unavailable.
+ */
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum perf_counter {
+    PERF_CACHE_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
+
+typedef struct perf_counters {
+    int fds[PERF_COUNTERS];
+    // Valid after perf_counters_read. Scaled up if the kernel had to multiplex the counters.
+    uint64_t values[PERF_COUNTERS];
+} perf_counters;
+
+// Opens every counter it can, zeroed and paused. Counters that couldn't be opened have an fd of -1. Returns how many
+// were opened.
+int perf_counters_open(perf_counters *pc);
+// Resume and pause counting. Counts add up across resume/pause pairs, so a benchmark can cover just its timed regions.
+void perf_counters_resume(perf_counters *pc);
+void perf_counters_pause(perf_counters *pc);
+// Reads the counts so far into values.
+void perf_counters_read(perf_counters *pc);
+void perf_counters_close(perf_counters *pc);
+// Prints each available counter divided by ops, on one line.
+void perf_counters_print(FILE *f, const perf_counters *pc, uint64_t ops);
+
+#endif
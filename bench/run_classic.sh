@@ -0,0 +1,32 @@
+#!/bin/sh
+# Runs the classic multi-threaded allocator benchmarks against tralloc (behind a lock, since it isn't thread-safe) and
+# glibc malloc, for each thread count given (default: 1 2 4).
+#
+# Usage: bench/run_classic.sh [threads...]
+# Set SECONDS_PER_RUN to change how long the timed benchmarks (larson, xmalloc-test) run. Default 2.
+
+set -e
+dir=$(dirname "$0")
+seconds=${SECONDS_PER_RUN:-2}
+[ $# -gt 0 ] || set -- 1 2 4
+
+for threads in "$@"; do
+    for allocator in tralloc-locked malloc; do
+        "$dir/larson" -a "$allocator" "$seconds" 8 1000 5000 100 4141 "$threads"
+    done
+done
+for threads in "$@"; do
+    for allocator in tralloc-locked malloc; do
+        "$dir/cache_thrash" -a "$allocator" "$threads" 1000 8 10000
+    done
+done
+for threads in "$@"; do
+    for allocator in tralloc-locked malloc; do
+        "$dir/cache_scratch" -a "$allocator" "$threads" 1000 8 10000
+    done
+done
+for threads in "$@"; do
+    for allocator in tralloc-locked malloc; do
+        "$dir/xmalloc_test" -a "$allocator" "$threads" "$seconds" 120
+    done
+done
@@ -0,0 +1,234 @@
+/*
+ * Microbenchmarks for tralloc and trfree against the system malloc.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trbench [-p] [-a allocator] [-n ops] [pattern...]
+ *     -p  also count hardware events (see perf_counters.h) during the timed calls and report them per operation
+ *     -a  run only "tralloc" or "malloc" instead of both
+ *     -n  approximate number of allocations per case (default 1000000)
+ * Patterns: fixed, random, lifo, fifo, ascending, large. All of them run by default.
+ *
+ * Calls are timed in batches, never one at a time, so the clock isn't part of what's measured.
+ */
+
+#include "harness.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct config {
+    uint64_t ops;
+} config;
+
+typedef struct pattern {
+    const char *name;
+    bench_fn fn;
+} pattern;
+
+static void fixed_churn(const bench_allocator *a, bench_result *r, void *ctx);
+static void random_churn(const bench_allocator *a, bench_result *r, void *ctx);
+static void lifo(const bench_allocator *a, bench_result *r, void *ctx);
+static void fifo(const bench_allocator *a, bench_result *r, void *ctx);
+static void ascending(const bench_allocator *a, bench_result *r, void *ctx);
+static void large(const bench_allocator *a, bench_result *r, void *ctx);
+
+// Keeps slots live allocations, and each round frees and refills batch randomly chosen slots.
+static void churn(const bench_allocator *a, bench_result *r, uint64_t ops, size_t slots, size_t min_size, size_t max_size);
+// Allocates batch objects, then frees them all, in reverse order if reverse is set.
+static void batch(const bench_allocator *a, bench_result *r, uint64_t ops, bool reverse);
+static inline size_t random_size(uint64_t *rng, size_t min_size, size_t max_size);
+
+static const pattern patterns[] = {
+    { "fixed", fixed_churn },
+    { "random", random_churn },
+    { "lifo", lifo },
+    { "fifo", fifo },
+    { "ascending", ascending },
+    { "large", large },
+};
+#define PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+// This bench compares plain tralloc with malloc. -a accepts only these.
+static const bench_allocator *const allocators[] = { &bench_tralloc, &bench_malloc };
+#define ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+int main(int argc, char **argv) {
+    config cfg = { 1000000 };
+    bool perf = false;
+    const bench_allocator *only = NULL;
+    int i;
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-p")) {
+            perf = true;
+        } else if(!strcmp(argv[i], "-a") && i + 1 < argc
+                && (only = bench_find_allocator_in(argv[i + 1], allocators, ALLOCATORS))) {
+            i++;
+        } else if(!strcmp(argv[i], "-n") && i + 1 < argc) {
+            cfg.ops = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: trbench [-p] [-a tralloc|malloc] [-n ops] [pattern...]\n");
+            return 2;
+        }
+    }
+    size_t p;
+    for(p = 0; p < PATTERNS; p++) {
+        if(i < argc) {
+            int j;
+            bool wanted = false;
+            for(j = i; j < argc; j++) wanted |= !strcmp(argv[j], patterns[p].name);
+            if(!wanted) continue;
+        }
+        size_t k;
+        for(k = 0; k < ALLOCATORS; k++) {
+            if(only && only != allocators[k]) continue;
+            bench_result result;
+            if(bench_run(patterns[p].fn, allocators[k], &cfg, perf, &result)) {
+                fprintf(stderr, "trbench: %s with %s failed\n", patterns[p].name, allocators[k]->name);
+                return 1;
+            }
+            bench_print(patterns[p].name, allocators[k], &result, perf);
+        }
+    }
+    return 0;
+}
+
+static void fixed_churn(const bench_allocator *a, bench_result *r, void *ctx) {
+    churn(a, r, ((config *)ctx)->ops, 1024, 64, 64);
+}
+
+static void random_churn(const bench_allocator *a, bench_result *r, void *ctx) {
+    churn(a, r, ((config *)ctx)->ops, 1024, 8, 4096);
+}
+
+static void lifo(const bench_allocator *a, bench_result *r, void *ctx) {
+    batch(a, r, ((config *)ctx)->ops, true);
+}
+
+static void fifo(const bench_allocator *a, bench_result *r, void *ctx) {
+    batch(a, r, ((config *)ctx)->ops, false);
+}
+
+// Frees chunks in ascending size order, kept apart by live spacers so they can't coalesce. Every insertion lands at the
+// bottom of the same right spine, which is the worst case for an unbalanced tree, and the allocations that follow have
+// to search down it.
+static void ascending(const bench_allocator *a, bench_result *r, void *ctx) {
+    const size_t n = 2000;
+    uint64_t ops = ((config *)ctx)->ops;
+    void **victims = bench_map(n * sizeof(void *));
+    void **spacers = bench_map(n * sizeof(void *));
+    size_t i;
+    for(i = 0; i < n; i++) {
+        victims[i] = a->alloc(16 + 8 * i);
+        spacers[i] = a->alloc(16);
+    }
+    while(r->allocs < ops) {
+        uint64_t start = bench_timer_start(r);
+        for(i = 0; i < n; i++) a->free(victims[i]);
+        r->free_ns += bench_timer_stop(r, start);
+        r->frees += n;
+        start = bench_timer_start(r);
+        for(i = 0; i < n; i++) {
+            victims[i] = a->alloc(16 + 8 * i);
+            *(char *)victims[i] = 0;
+        }
+        r->alloc_ns += bench_timer_stop(r, start);
+        r->allocs += n;
+    }
+    for(i = 0; i < n; i++) {
+        a->free(victims[i]);
+        a->free(spacers[i]);
+    }
+    bench_unmap(victims, n * sizeof(void *));
+    bench_unmap(spacers, n * sizeof(void *));
+}
+
+static void large(const bench_allocator *a, bench_result *r, void *ctx) {
+    // Large blocks are slow to touch whatever the allocator, so run fewer of them.
+    churn(a, r, ((config *)ctx)->ops / 64, 64, 64 * 1024, 1024 * 1024);
+}
+
+static void churn(const bench_allocator *a, bench_result *r, uint64_t ops, size_t slots, size_t min_size, size_t max_size) {
+    const size_t per_round = 64;
+    void **live = bench_map(slots * sizeof(void *));
+    size_t *picked = bench_map(per_round * sizeof(size_t));
+    uint64_t rng = 88172645463325252ULL;
+    size_t i;
+    for(i = 0; i < slots; i++) live[i] = a->alloc(random_size(&rng, min_size, max_size));
+    while(r->allocs < ops) {
+        for(i = 0; i < per_round; i++) picked[i] = bench_rand(&rng) % slots;
+        uint64_t start = bench_timer_start(r);
+        for(i = 0; i < per_round; i++) {
+            if(!live[picked[i]]) continue;
+            a->free(live[picked[i]]);
+            live[picked[i]] = NULL;
+            r->frees++;
+        }
+        r->free_ns += bench_timer_stop(r, start);
+        start = bench_timer_start(r);
+        for(i = 0; i < per_round; i++) {
+            if(live[picked[i]]) continue;
+            live[picked[i]] = a->alloc(random_size(&rng, min_size, max_size));
+            *(char *)live[picked[i]] = 0;
+            r->allocs++;
+        }
+        r->alloc_ns += bench_timer_stop(r, start);
+    }
+    for(i = 0; i < slots; i++) a->free(live[i]);
+    bench_unmap(live, slots * sizeof(void *));
+    bench_unmap(picked, per_round * sizeof(size_t));
+}
+
+static void batch(const bench_allocator *a, bench_result *r, uint64_t ops, bool reverse) {
+    const size_t n = 1024;
+    void **objects = bench_map(n * sizeof(void *));
+    size_t *sizes = bench_map(n * sizeof(size_t));
+    uint64_t rng = 2463534242ULL;
+    size_t i;
+    while(r->allocs < ops) {
+        for(i = 0; i < n; i++) sizes[i] = random_size(&rng, 8, 512);
+        uint64_t start = bench_timer_start(r);
+        for(i = 0; i < n; i++) {
+            objects[i] = a->alloc(sizes[i]);
+            *(char *)objects[i] = 0;
+        }
+        r->alloc_ns += bench_timer_stop(r, start);
+        r->allocs += n;
+        start = bench_timer_start(r);
+        if(reverse) for(i = n; i-- > 0;) a->free(objects[i]);
+        else for(i = 0; i < n; i++) a->free(objects[i]);
+        r->free_ns += bench_timer_stop(r, start);
+        r->frees += n;
+    }
+    bench_unmap(objects, n * sizeof(void *));
+    bench_unmap(sizes, n * sizeof(size_t));
+}
+
+static inline size_t random_size(uint64_t *rng, size_t min_size, size_t max_size) {
+    return min_size + bench_rand(rng) % (max_size - min_size + 1);
+}
@@ -0,0 +1,256 @@
+/*
+ * Long-running fragmentation and heap growth benchmark for tralloc and the system malloc.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trbloat [-c] [-a allocator] [-t ticks] [-r rate] [-s samples] [-S seed]
+ *     -c  print samples as CSV instead of a table
+ *     -a  run only "tralloc" or "malloc" instead of both
+ *     -t  length of the simulated run in ticks (default 100000)
+ *     -r  average allocations per tick (default 16)
+ *     -s  number of samples over the run (default 40)
+ *     -S  random seed
+ *
+ * A process that runs for weeks sees a mix of lifetimes that short benchmarks never get to: most objects die within a
+ * few ticks, some live for a while, and a few outlive everything around them and pin whatever chunk they landed in. Load
+ * rises and falls over a simulated day, and the busy half of each day asks for bigger buffers. Every tick first frees
+ * whatever has expired and then allocates. The benchmark samples heap size, live bytes, free bytes and (for tralloc) the
+ * largest free chunk as it goes, so slow growth shows up as a heap that keeps climbing while live bytes stay flat.
+ */
+
+#include "harness.h"
+#include "../tralloc.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#define DAY_TICKS 10000
+
+typedef struct bloat_sample {
+    uint64_t tick;
+    uint64_t heap;
+    // Bytes the benchmark asked for and hasn't freed yet.
+    uint64_t live;
+    uint64_t free;
+    // Only tralloc can tell us this. 0 for malloc.
+    uint64_t largest_free;
+    uint64_t objects;
+} bloat_sample;
+
+typedef struct bloat_config {
+    uint64_t ticks;
+    uint64_t rate;
+    uint64_t samples;
+    uint64_t seed;
+    // Shared with the child, which fills in samples + 1 entries (the last one at the end of the run).
+    bloat_sample *out;
+} bloat_config;
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx);
+static void sample(const bench_allocator *a, uint64_t tick, uint64_t live, uint64_t objects, bloat_sample *out);
+static void print_table(const bench_allocator *a, const bloat_config *cfg);
+static void print_csv(const bench_allocator *a, const bloat_config *cfg);
+static uint64_t lifetime(uint64_t *rng);
+static size_t object_size(uint64_t *rng, uint64_t tick);
+// Allocations this tick: rate scaled by a triangle wave between half and one and a half times over each day.
+static uint64_t tick_allocs(const bloat_config *cfg, uint64_t tick);
+
+// This bench compares plain tralloc with malloc. -a accepts only these.
+static const bench_allocator *const allocators[] = { &bench_tralloc, &bench_malloc };
+#define ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+int main(int argc, char **argv) {
+    bloat_config cfg = { 100000, 16, 40, 88172645463325252ULL, NULL };
+    bool csv = false;
+    const bench_allocator *only = NULL;
+    int i;
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-c")) {
+            csv = true;
+        } else if(!strcmp(argv[i], "-a") && i + 1 < argc
+                && (only = bench_find_allocator_in(argv[i + 1], allocators, ALLOCATORS))) {
+            i++;
+        } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+            cfg.ticks = strtoull(argv[++i], NULL, 10);
+        } else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+            cfg.rate = strtoull(argv[++i], NULL, 10);
+        } else if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+            cfg.samples = strtoull(argv[++i], NULL, 10);
+        } else if(!strcmp(argv[i], "-S") && i + 1 < argc) {
+            cfg.seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: trbloat [-c] [-a tralloc|malloc] [-t ticks] [-r rate] [-s samples] [-S seed]\n");
+            return 2;
+        }
+    }
+    if(!cfg.ticks || !cfg.rate || !cfg.samples || !cfg.seed) {
+        fprintf(stderr, "trbloat: ticks, rate, samples and seed must be non-zero\n");
+        return 2;
+    }
+    if(cfg.samples > cfg.ticks) cfg.samples = cfg.ticks;
+    cfg.out = bench_map_shared((cfg.samples + 1) * sizeof(bloat_sample));
+    if(csv) printf("allocator,tick,heap,live,free,largest_free,objects\n");
+    size_t k;
+    for(k = 0; k < ALLOCATORS; k++) {
+        if(only && only != allocators[k]) continue;
+        bench_result result;
+        if(bench_run(run, allocators[k], &cfg, false, &result)) {
+            fprintf(stderr, "trbloat: run with %s failed\n", allocators[k]->name);
+            return 1;
+        }
+        if(csv) {
+            print_csv(allocators[k], &cfg);
+        } else {
+            print_table(allocators[k], &cfg);
+            bench_print("bloat", allocators[k], &result, false);
+            printf("\n");
+        }
+    }
+    return 0;
+}
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx) {
+    bloat_config *cfg = ctx;
+    // Every allocation could in principle still be alive at the end. The mapping is only touched as far as it's used.
+    size_t capacity = (cfg->rate * 3 / 2 + 1) * cfg->ticks;
+    bench_object *heap = bench_map(capacity * sizeof(bench_object));
+    size_t count = 0;
+    uint64_t live = 0;
+    uint64_t rng = cfg->seed;
+    uint64_t next_sample = 0;
+    uint64_t taken = 0;
+    uint64_t tick;
+    for(tick = 0; tick < cfg->ticks; tick++) {
+        if(tick == next_sample) {
+            sample(a, tick, live, count, &cfg->out[taken++]);
+            next_sample = taken * cfg->ticks / cfg->samples;
+        }
+        uint64_t start = bench_now_ns();
+        uint64_t freed = 0;
+        while(count && heap[0].death <= tick) {
+            bench_object o = bench_live_pop(heap, &count);
+            a->free(o.ptr);
+            live -= o.size;
+            freed++;
+        }
+        r->free_ns += bench_now_ns() - start;
+        r->frees += freed;
+        uint64_t n = tick_allocs(cfg, tick);
+        uint64_t i;
+        for(i = 0; i < n; i++) {
+            bench_object o = { tick + 1 + lifetime(&rng), NULL, object_size(&rng, tick) };
+            start = bench_now_ns();
+            o.ptr = a->alloc(o.size);
+            r->alloc_ns += bench_now_ns() - start;
+            // Touch the whole object, the way a real caller would fill it in.
+            memset(o.ptr, 0, o.size);
+            bench_live_push(heap, &count, o);
+            live += o.size;
+        }
+        r->allocs += n;
+    }
+    sample(a, tick, live, count, &cfg->out[taken]);
+    while(count) a->free(bench_live_pop(heap, &count).ptr);
+    bench_unmap(heap, capacity * sizeof(bench_object));
+}
+
+static void sample(const bench_allocator *a, uint64_t tick, uint64_t live, uint64_t objects, bloat_sample *out) {
+    out->tick = tick;
+    out->live = live;
+    out->objects = objects;
+    if(a == &bench_tralloc) {
+        struct trstats stats;
+        trstats(&stats);
+        out->heap = stats.heap_size;
+        out->free = stats.bytes_free;
+        out->largest_free = stats.largest_free;
+    } else {
+        struct mallinfo2 info = mallinfo2();
+        out->heap = info.arena + info.hblkhd;
+        out->free = info.fordblks;
+        out->largest_free = 0;
+    }
+}
+
+static void print_table(const bench_allocator *a, const bloat_config *cfg) {
+    printf("%s: %llu ticks, %llu allocations per tick\n", a->name, (unsigned long long)cfg->ticks,
+        (unsigned long long)cfg->rate);
+    printf("%10s %12s %12s %12s %12s %10s %9s\n", "tick", "heap", "live", "free", "largest", "objects", "heap/live");
+    uint64_t peak = 0;
+    uint64_t i;
+    for(i = 0; i <= cfg->samples; i++) {
+        const bloat_sample *s = &cfg->out[i];
+        if(s->heap > peak) peak = s->heap;
+        printf("%10llu %12llu %12llu %12llu ", (unsigned long long)s->tick, (unsigned long long)s->heap,
+            (unsigned long long)s->live, (unsigned long long)s->free);
+        if(a == &bench_tralloc) printf("%12llu", (unsigned long long)s->largest_free);
+        else printf("%12s", "-");
+        printf(" %10llu %9.2f\n", (unsigned long long)s->objects, s->live ? (double)s->heap / (double)s->live : 0.0);
+    }
+    // The first half of the run is warm-up. If the heap keeps growing after that while live bytes don't, that's the bloat.
+    const bloat_sample *mid = &cfg->out[cfg->samples / 2];
+    const bloat_sample *end = &cfg->out[cfg->samples];
+    printf("peak heap %llu, final heap %llu, over the second half heap %+lld and live %+lld\n", (unsigned long long)peak,
+        (unsigned long long)end->heap, (long long)(end->heap - mid->heap), (long long)(end->live - mid->live));
+}
+
+static void print_csv(const bench_allocator *a, const bloat_config *cfg) {
+    uint64_t i;
+    for(i = 0; i <= cfg->samples; i++) {
+        const bloat_sample *s = &cfg->out[i];
+        printf("%s,%llu,%llu,%llu,%llu,%llu,%llu\n", a->name, (unsigned long long)s->tick, (unsigned long long)s->heap,
+            (unsigned long long)s->live, (unsigned long long)s->free, (unsigned long long)s->largest_free,
+            (unsigned long long)s->objects);
+    }
+}
+
+static uint64_t lifetime(uint64_t *rng) {
+    double mean;
+    double pick = bench_uniform(rng);
+    if(pick < 0.85) mean = 8;
+    else if(pick < 0.98) mean = 2000;
+    else mean = 3.0 * DAY_TICKS;
+    return (uint64_t)(-mean * log(1.0 - bench_uniform(rng)));
+}
+
+static size_t object_size(uint64_t *rng, uint64_t tick) {
+    bool busy = tick % DAY_TICKS < DAY_TICKS / 2;
+    double pick = bench_uniform(rng);
+    if(pick < 0.60) return 16 + bench_rand(rng) % 113;
+    if(pick < (busy ? 0.85 : 0.95)) return 128 + bench_rand(rng) % 1921;
+    if(pick < (busy ? 0.98 : 0.995)) return 2048 + bench_rand(rng) % 30721;
+    return 32768 + bench_rand(rng) % 229377;
+}
+
+static uint64_t tick_allocs(const bloat_config *cfg, uint64_t tick) {
+    uint64_t phase = tick % DAY_TICKS;
+    uint64_t distance = phase < DAY_TICKS / 2 ? phase : DAY_TICKS - phase;
+    return cfg->rate / 2 + cfg->rate * distance * 2 / DAY_TICKS;
+}
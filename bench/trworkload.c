@@ -0,0 +1,359 @@
+/*
+ * Synthetic allocation workloads with configurable size and lifetime distributions.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trworkload [-a allocator] [-s sizes] [-l lifetimes] [-t threads] [-r resize_ratio] [-n ops] [-S seed]
+ *     -a  run only this allocator instead of tralloc and malloc
+ *     -s  size distribution (default lognormal:4.5,1.2):
+ *             lognormal:MU,SIGMA   ln(size) is normal with mean MU and standard deviation SIGMA
+ *             bimodal:A,B,P        sizes within 25% of A, or of B with probability P
+ *             hist:FILE            a histogram written by trsize_hist_dump; sizes are drawn uniformly within each class
+ *     -l  lifetime distribution, counted in the thread's own operations (default exp:1000):
+ *             exp:MEAN, lognormal:MU,SIGMA or fixed:N
+ *     -t  threads (default 1). With more than one, tralloc runs as tralloc-locked.
+ *     -r  fraction of operations that resize a live object instead of allocating a new one (default 0)
+ *     -n  operations per thread (default 1000000)
+ *     -S  random seed
+ *
+ * tralloc has no realloc, so a resize is what a caller would do without one: allocate the new size, copy, free the old
+ * object. Every operation is drawn before the run starts, and each allocator gets the same ones, so only allocator
+ * work and the bookkeeping both share are timed.
+ *
+ * To reproduce a production size mix, have the process write trsize_hist_dump to a file and pass it with -s hist:FILE.
+ */
+
+#include "harness.h"
+#include "../tralloc.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_HIST_CLASSES 4096
+
+enum dist_kind {
+    DIST_LOGNORMAL,
+    DIST_BIMODAL,
+    DIST_HIST,
+    DIST_EXP,
+    DIST_FIXED
+};
+
+typedef struct dist {
+    enum dist_kind kind;
+    double a;
+    double b;
+    double p;
+    // DIST_HIST only. cumulative[i] counts allocations in classes 0 through i.
+    size_t classes;
+    size_t min[MAX_HIST_CLASSES];
+    size_t max[MAX_HIST_CLASSES];
+    double cumulative[MAX_HIST_CLASSES];
+} dist;
+
+// One operation of a thread's stream, drawn before the run.
+typedef struct op {
+    size_t size;
+    uint64_t lifetime;
+    // If resize is set, the op resizes the live object picked by victim instead of allocating a new one.
+    uint64_t victim;
+    bool resize;
+} op;
+
+typedef struct config {
+    size_t threads;
+    uint64_t ops;
+    // threads streams of ops operations each.
+    op *streams;
+} config;
+
+// What each run hands back in bench_result.extra.
+enum workload_extra {
+    ELAPSED_NS,
+    RESIZES,
+    PEAK_LIVE_BYTES,
+    HEAP_BYTES
+};
+
+typedef struct worker_arg {
+    const bench_allocator *allocator;
+    const config *cfg;
+    const op *stream;
+    bench_object *heap;
+    size_t count;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t resizes;
+} worker_arg;
+
+static uint64_t live_bytes;
+static uint64_t peak_live_bytes;
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx);
+static void *worker(void *arg);
+static void add_live(int64_t delta);
+static bool parse_dist(const char *spec, dist *d);
+static bool load_hist(const char *path, dist *d);
+static double sample(const dist *d, uint64_t *rng);
+static double normal(uint64_t *rng);
+
+// Big enough that they don't belong on the stack.
+static dist sizes, lifetimes;
+
+int main(int argc, char **argv) {
+    config cfg = { 1, 1000000, NULL };
+    const bench_allocator *only = NULL;
+    double resize_ratio = 0.0;
+    uint64_t seed = 88172645463325252ULL;
+    bool ok = parse_dist("lognormal:4.5,1.2", &sizes) && parse_dist("exp:1000", &lifetimes);
+    int i;
+    for(i = 1; ok && i < argc; i++) {
+        if(!strcmp(argv[i], "-a") && i + 1 < argc) {
+            ok = (only = bench_find_allocator(argv[++i])) != NULL;
+        } else if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+            ok = parse_dist(argv[++i], &sizes) && sizes.kind != DIST_EXP;
+        } else if(!strcmp(argv[i], "-l") && i + 1 < argc) {
+            ok = parse_dist(argv[++i], &lifetimes) && lifetimes.kind != DIST_BIMODAL && lifetimes.kind != DIST_HIST;
+        } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+            cfg.threads = strtoull(argv[++i], NULL, 10);
+        } else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+            resize_ratio = strtod(argv[++i], NULL);
+        } else if(!strcmp(argv[i], "-n") && i + 1 < argc) {
+            cfg.ops = strtoull(argv[++i], NULL, 10);
+        } else if(!strcmp(argv[i], "-S") && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            ok = false;
+        }
+    }
+    if(!ok || !cfg.threads || !cfg.ops || !seed || resize_ratio < 0.0 || resize_ratio > 1.0) {
+        fprintf(stderr, "usage: trworkload [-a allocator] [-s sizes] [-l lifetimes] [-t threads] [-r resize_ratio] "
+            "[-n ops] [-S seed]\n");
+        return 2;
+    }
+    if(only == &bench_tralloc && cfg.threads > 1) {
+        fprintf(stderr, "trworkload: tralloc isn't thread-safe, use tralloc-locked\n");
+        return 2;
+    }
+    cfg.streams = bench_map(cfg.threads * cfg.ops * sizeof(op));
+    uint64_t rng = seed;
+    uint64_t n;
+    for(n = 0; n < cfg.threads * cfg.ops; n++) {
+        op *o = &cfg.streams[n];
+        double size = sample(&sizes, &rng);
+        o->size = size < 1.0 ? 1 : size > 1e9 ? 1000000000 : (size_t)size;
+        o->lifetime = (uint64_t)sample(&lifetimes, &rng);
+        o->resize = bench_uniform(&rng) < resize_ratio;
+        o->victim = bench_rand(&rng);
+    }
+    const bench_allocator *allocators[2];
+    size_t count = 0, k;
+    if(only) {
+        allocators[count++] = only;
+    } else {
+        allocators[count++] = cfg.threads > 1 ? &bench_tralloc_locked : &bench_tralloc;
+        allocators[count++] = &bench_malloc;
+    }
+    for(k = 0; k < count; k++) {
+        bench_result result;
+        if(bench_run(run, allocators[k], &cfg, false, &result)) {
+            fprintf(stderr, "trworkload: run with %s failed\n", allocators[k]->name);
+            return 1;
+        }
+        double seconds = (double)result.extra[ELAPSED_NS] / 1e9;
+        uint64_t peak = result.extra[PEAK_LIVE_BYTES];
+        uint64_t heap = result.extra[HEAP_BYTES];
+        printf("%-14s %3zu threads %12.0f ops/s   %llu allocs, %llu frees, %llu resizes   peak live %llu   heap at end %llu "
+            "(%.2fx peak live)\n", allocators[k]->name, cfg.threads, (double)(result.allocs + result.frees) / seconds,
+            (unsigned long long)result.allocs, (unsigned long long)result.frees,
+            (unsigned long long)result.extra[RESIZES], (unsigned long long)peak, (unsigned long long)heap,
+            peak ? (double)heap / (double)peak : 0.0);
+    }
+    return 0;
+}
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx) {
+    const config *cfg = ctx;
+    pthread_t *threads = bench_map(cfg->threads * sizeof(pthread_t));
+    worker_arg *args = bench_map(cfg->threads * sizeof(worker_arg));
+    size_t t;
+    for(t = 0; t < cfg->threads; t++) {
+        args[t].allocator = a;
+        args[t].cfg = cfg;
+        args[t].stream = &cfg->streams[t * cfg->ops];
+        // Sized for a thread whose objects all outlive the run.
+        args[t].heap = bench_map(cfg->ops * sizeof(bench_object));
+    }
+    uint64_t start = bench_now_ns();
+    for(t = 0; t < cfg->threads; t++) {
+        if(pthread_create(&threads[t], NULL, worker, &args[t])) _exit(1);
+    }
+    for(t = 0; t < cfg->threads; t++) pthread_join(threads[t], NULL);
+    r->extra[ELAPSED_NS] = bench_now_ns() - start;
+    // Measured while the objects still alive at the end are, since malloc gives memory back once they're freed.
+    r->extra[HEAP_BYTES] = bench_heap_bytes(a);
+    r->extra[PEAK_LIVE_BYTES] = peak_live_bytes;
+    for(t = 0; t < cfg->threads; t++) {
+        r->allocs += args[t].allocs;
+        r->frees += args[t].frees;
+        r->extra[RESIZES] += args[t].resizes;
+        while(args[t].count) a->free(bench_live_pop(args[t].heap, &args[t].count).ptr);
+        bench_unmap(args[t].heap, cfg->ops * sizeof(bench_object));
+    }
+    bench_unmap(threads, cfg->threads * sizeof(pthread_t));
+    bench_unmap(args, cfg->threads * sizeof(worker_arg));
+}
+
+static void *worker(void *arg) {
+    worker_arg *w = arg;
+    const bench_allocator *a = w->allocator;
+    uint64_t i;
+    for(i = 0; i < w->cfg->ops; i++) {
+        const op *o = &w->stream[i];
+        while(w->count && w->heap[0].death <= i) {
+            bench_object dead = bench_live_pop(w->heap, &w->count);
+            a->free(dead.ptr);
+            add_live(-(int64_t)dead.size);
+            w->frees++;
+        }
+        void *ptr = a->alloc(o->size);
+        // Fill in the first cache line, as a caller initializing a header would. Touching all of a large object would
+        // swamp the allocator's cost.
+        memset(ptr, 0, o->size < 64 ? o->size : 64);
+        w->allocs++;
+        if(o->resize && w->count) {
+            // Changing the size doesn't change when the object dies, so its place in the heap stays valid.
+            bench_object *victim = &w->heap[o->victim % w->count];
+            memcpy(ptr, victim->ptr, victim->size < o->size ? victim->size : o->size);
+            a->free(victim->ptr);
+            add_live((int64_t)o->size - (int64_t)victim->size);
+            victim->ptr = ptr;
+            victim->size = o->size;
+            w->frees++;
+            w->resizes++;
+        } else {
+            bench_object obj = { i + 1 + o->lifetime, ptr, o->size };
+            bench_live_push(w->heap, &w->count, obj);
+            add_live((int64_t)o->size);
+        }
+    }
+    return NULL;
+}
+
+static void add_live(int64_t delta) {
+    uint64_t now = __atomic_add_fetch(&live_bytes, (uint64_t)delta, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+    while(now > peak && !__atomic_compare_exchange_n(&peak_live_bytes, &peak, now, true, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED));
+}
+
+static bool parse_dist(const char *spec, dist *d) {
+    memset(d, 0, sizeof(*d));
+    if(!strncmp(spec, "lognormal:", 10)) {
+        d->kind = DIST_LOGNORMAL;
+        return sscanf(spec + 10, "%lf,%lf", &d->a, &d->b) == 2 && d->b >= 0.0;
+    } else if(!strncmp(spec, "bimodal:", 8)) {
+        d->kind = DIST_BIMODAL;
+        return sscanf(spec + 8, "%lf,%lf,%lf", &d->a, &d->b, &d->p) == 3 && d->a >= 1.0 && d->b >= 1.0 && d->p >= 0.0
+            && d->p <= 1.0;
+    } else if(!strncmp(spec, "hist:", 5)) {
+        d->kind = DIST_HIST;
+        return load_hist(spec + 5, d);
+    } else if(!strncmp(spec, "exp:", 4)) {
+        d->kind = DIST_EXP;
+        return sscanf(spec + 4, "%lf", &d->a) == 1 && d->a >= 0.0;
+    } else if(!strncmp(spec, "fixed:", 6)) {
+        d->kind = DIST_FIXED;
+        return sscanf(spec + 6, "%lf", &d->a) == 1 && d->a >= 0.0;
+    }
+    return false;
+}
+
+static bool load_hist(const char *path, dist *d) {
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        perror(path);
+        return false;
+    }
+    char line[256];
+    double total = 0.0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), f)) {
+        unsigned long long min, max, count;
+        if(line[0] == '#' || line[0] == '\n') continue;
+        if(sscanf(line, "%llu %llu %llu", &min, &max, &count) != 3 || max < min || d->classes == MAX_HIST_CLASSES) {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            ok = false;
+        } else if(count) {
+            total += (double)count;
+            d->min[d->classes] = (size_t)min;
+            d->max[d->classes] = (size_t)max;
+            d->cumulative[d->classes++] = total;
+        }
+    }
+    fclose(f);
+    if(ok && !d->classes) fprintf(stderr, "%s: empty histogram\n", path);
+    return ok && d->classes;
+}
+
+static double sample(const dist *d, uint64_t *rng) {
+    switch(d->kind) {
+    case DIST_LOGNORMAL:
+        return exp(d->a + d->b * normal(rng));
+    case DIST_BIMODAL: {
+        double mode = bench_uniform(rng) < d->p ? d->b : d->a;
+        return mode * (0.75 + 0.5 * bench_uniform(rng));
+    }
+    case DIST_HIST: {
+        // Binary search for the first class whose cumulative count exceeds the target.
+        double target = bench_uniform(rng) * d->cumulative[d->classes - 1];
+        size_t lo = 0, hi = d->classes - 1;
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if(d->cumulative[mid] > target) hi = mid;
+            else lo = mid + 1;
+        }
+        // The top class runs to SIZE_MAX. Don't draw from all of it.
+        size_t max = d->max[lo] - d->min[lo] > d->min[lo] ? 2 * d->min[lo] : d->max[lo];
+        return (double)(d->min[lo] + bench_rand(rng) % (max - d->min[lo] + 1));
+    }
+    case DIST_EXP:
+        return -d->a * log(1.0 - bench_uniform(rng));
+    case DIST_FIXED:
+        return d->a;
+    }
+    return 0.0;
+}
+
+// Box-Muller. Throws away the second value, which is fine since sampling happens before the run.
+static double normal(uint64_t *rng) {
+    return sqrt(-2.0 * log(1.0 - bench_uniform(rng))) * cos(6.283185307179586 * bench_uniform(rng));
+}
@@ -0,0 +1,298 @@
+/*
+ * Adversarial benchmarks that build the inputs tralloc's free tree handles worst.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trworst [-a allocator] [-n chunks] [pattern...]
+ *     -a  run only "tralloc" or "malloc" instead of both
+ *     -n  chunks each pattern works with (default 4096)
+ * Patterns: increasing, decreasing, equal, alternating, splits. All of them run by default.
+ *
+ * The free tree is an unbalanced binary search tree, so its cost depends on the order chunks arrive in. These patterns
+ * feed it orders that make it degenerate. Averages hide that, so every call is timed on its own and the worst one is
+ * reported, together with the tallest the tree got and the most nodes a single insertion or search visited.
+ * Timing each call separately adds the cost of reading the clock to every operation, so compare means with trbench's,
+ * not with these.
+ */
+
+#include "harness.h"
+#include "../tralloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// What each case hands back in bench_result.extra.
+enum worst_extra {
+    MAX_ALLOC_NS,
+    MAX_FREE_NS,
+    TREE_MAX_HEIGHT,
+    TREE_SEARCH_MAX_VISITS,
+    TREE_ADD_MAX_VISITS
+};
+
+typedef struct config {
+    size_t chunks;
+} config;
+
+typedef struct pattern {
+    const char *name;
+    bench_fn fn;
+} pattern;
+
+static void increasing(const bench_allocator *a, bench_result *r, void *ctx);
+static void decreasing(const bench_allocator *a, bench_result *r, void *ctx);
+static void equal(const bench_allocator *a, bench_result *r, void *ctx);
+static void alternating(const bench_allocator *a, bench_result *r, void *ctx);
+static void splits(const bench_allocator *a, bench_result *r, void *ctx);
+
+// Allocates chunks of victim_size(i) bytes with a live spacer after each, so that freeing victims never coalesces them.
+static void make_victims(const bench_allocator *a, void **victims, void **spacers, size_t n);
+static void free_all(const bench_allocator *a, void **ptrs, size_t n);
+static void *timed_alloc(const bench_allocator *a, bench_result *r, size_t size);
+static void timed_free(const bench_allocator *a, bench_result *r, void *ptr);
+static void finish(const bench_allocator *a, bench_result *r);
+static void print_result(const char *name, const bench_allocator *a, const bench_result *r);
+static inline size_t victim_size(size_t i) { return 32 + 8 * i; }
+
+static const pattern patterns[] = {
+    { "increasing", increasing },
+    { "decreasing", decreasing },
+    { "equal", equal },
+    { "alternating", alternating },
+    { "splits", splits },
+};
+#define PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+// This bench compares plain tralloc with malloc. -a accepts only these.
+static const bench_allocator *const allocators[] = { &bench_tralloc, &bench_malloc };
+#define ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+int main(int argc, char **argv) {
+    config cfg = { 4096 };
+    const bench_allocator *only = NULL;
+    int i;
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-a") && i + 1 < argc
+                && (only = bench_find_allocator_in(argv[i + 1], allocators, ALLOCATORS))) {
+            i++;
+        } else if(!strcmp(argv[i], "-n") && i + 1 < argc) {
+            cfg.chunks = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: trworst [-a tralloc|malloc] [-n chunks] [pattern...]\n");
+            return 2;
+        }
+    }
+    if(!cfg.chunks) {
+        fprintf(stderr, "trworst: chunks must be non-zero\n");
+        return 2;
+    }
+    printf("%-12s %-8s %21s %21s %7s %9s %9s\n", "", "", "alloc ns mean/max", "free ns mean/max", "height",
+        "search", "insert");
+    size_t p;
+    for(p = 0; p < PATTERNS; p++) {
+        if(i < argc) {
+            int j;
+            bool wanted = false;
+            for(j = i; j < argc; j++) wanted |= !strcmp(argv[j], patterns[p].name);
+            if(!wanted) continue;
+        }
+        size_t k;
+        for(k = 0; k < ALLOCATORS; k++) {
+            if(only && only != allocators[k]) continue;
+            bench_result result;
+            if(bench_run(patterns[p].fn, allocators[k], &cfg, false, &result)) {
+                fprintf(stderr, "trworst: %s with %s failed\n", patterns[p].name, allocators[k]->name);
+                return 1;
+            }
+            print_result(patterns[p].name, allocators[k], &result);
+        }
+    }
+    return 0;
+}
+
+// Every insertion goes to the bottom of the right spine, and so does the search for the largest size.
+static void increasing(const bench_allocator *a, bench_result *r, void *ctx) {
+    size_t n = ((config *)ctx)->chunks;
+    void **victims = bench_map(n * sizeof(void *));
+    void **spacers = bench_map(n * sizeof(void *));
+    make_victims(a, victims, spacers, n);
+    size_t i;
+    for(i = 0; i < n; i++) timed_free(a, r, victims[i]);
+    for(i = n; i-- > 0;) victims[i] = timed_alloc(a, r, victim_size(i));
+    finish(a, r);
+    free_all(a, victims, n);
+    free_all(a, spacers, n);
+    bench_unmap(victims, n * sizeof(void *));
+    bench_unmap(spacers, n * sizeof(void *));
+}
+
+// The mirror image: a left spine. Searches stop at the root, but every insertion walks the whole spine.
+static void decreasing(const bench_allocator *a, bench_result *r, void *ctx) {
+    size_t n = ((config *)ctx)->chunks;
+    void **victims = bench_map(n * sizeof(void *));
+    void **spacers = bench_map(n * sizeof(void *));
+    make_victims(a, victims, spacers, n);
+    size_t i;
+    for(i = n; i-- > 0;) timed_free(a, r, victims[i]);
+    for(i = 0; i < n; i++) victims[i] = timed_alloc(a, r, victim_size(i));
+    finish(a, r);
+    free_all(a, victims, n);
+    free_all(a, spacers, n);
+    bench_unmap(victims, n * sizeof(void *));
+    bench_unmap(spacers, n * sizeof(void *));
+}
+
+// Equal sizes never compare less or greater, so only the tie-breaking keeps the tree from becoming a list.
+static void equal(const bench_allocator *a, bench_result *r, void *ctx) {
+    size_t n = ((config *)ctx)->chunks;
+    void **victims = bench_map(n * sizeof(void *));
+    void **spacers = bench_map(n * sizeof(void *));
+    size_t i;
+    for(i = 0; i < n; i++) {
+        victims[i] = a->alloc(256);
+        spacers[i] = a->alloc(16);
+    }
+    for(i = 0; i < n; i++) timed_free(a, r, victims[i]);
+    for(i = 0; i < n; i++) victims[i] = timed_alloc(a, r, 256);
+    finish(a, r);
+    free_all(a, victims, n);
+    free_all(a, spacers, n);
+    bench_unmap(victims, n * sizeof(void *));
+    bench_unmap(spacers, n * sizeof(void *));
+}
+
+// Frees n huge chunks, then alternates tiny and huge requests. Every tiny request is carved out of a huge hole, and the
+// remainder is a few bytes too small for the next huge request, so the tree fills up with almost-huge chunks that nothing
+// can use while the heap keeps growing.
+static void alternating(const bench_allocator *a, bench_result *r, void *ctx) {
+    const size_t huge_size = 64 * 1024;
+    size_t n = ((config *)ctx)->chunks;
+    void **huge = bench_map(n * sizeof(void *));
+    void **spacers = bench_map(n * sizeof(void *));
+    void **tiny = bench_map(n * sizeof(void *));
+    size_t i;
+    for(i = 0; i < n; i++) {
+        huge[i] = a->alloc(huge_size);
+        spacers[i] = a->alloc(16);
+    }
+    free_all(a, huge, n);
+    for(i = 0; i < n; i++) {
+        tiny[i] = timed_alloc(a, r, 16);
+        huge[i] = timed_alloc(a, r, huge_size);
+    }
+    finish(a, r);
+    free_all(a, huge, n);
+    free_all(a, tiny, n);
+    free_all(a, spacers, n);
+    bench_unmap(huge, n * sizeof(void *));
+    bench_unmap(spacers, n * sizeof(void *));
+    bench_unmap(tiny, n * sizeof(void *));
+}
+
+// A right spine of medium chunks with one large chunk at the far end. Every request is bigger than all the medium chunks,
+// so the search walks the spine to the large chunk and splits it, and the remainder, still the largest free chunk, walks
+// the spine again on its way back in.
+static void splits(const bench_allocator *a, bench_result *r, void *ctx) {
+    size_t n = ((config *)ctx)->chunks;
+    void **victims = bench_map(n * sizeof(void *));
+    void **spacers = bench_map(n * sizeof(void *));
+    void **pieces = bench_map(n * sizeof(void *));
+    make_victims(a, victims, spacers, n);
+    size_t piece = victim_size(n);
+    void *large = a->alloc(n * (piece + 64));
+    void *fence = a->alloc(16);
+    size_t i;
+    for(i = 0; i < n; i++) a->free(victims[i]);
+    a->free(large);
+    for(i = 0; i < n; i++) pieces[i] = timed_alloc(a, r, piece);
+    for(i = 0; i < n; i++) timed_free(a, r, pieces[i]);
+    finish(a, r);
+    a->free(fence);
+    free_all(a, spacers, n);
+    bench_unmap(victims, n * sizeof(void *));
+    bench_unmap(spacers, n * sizeof(void *));
+    bench_unmap(pieces, n * sizeof(void *));
+}
+
+static void make_victims(const bench_allocator *a, void **victims, void **spacers, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++) {
+        victims[i] = a->alloc(victim_size(i));
+        spacers[i] = a->alloc(16);
+    }
+}
+
+static void free_all(const bench_allocator *a, void **ptrs, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++) a->free(ptrs[i]);
+}
+
+static void *timed_alloc(const bench_allocator *a, bench_result *r, size_t size) {
+    uint64_t start = bench_now_ns();
+    void *ptr = a->alloc(size);
+    uint64_t elapsed = bench_now_ns() - start;
+    *(char *)ptr = 0;
+    r->alloc_ns += elapsed;
+    r->allocs++;
+    if(elapsed > r->extra[MAX_ALLOC_NS]) r->extra[MAX_ALLOC_NS] = elapsed;
+    return ptr;
+}
+
+static void timed_free(const bench_allocator *a, bench_result *r, void *ptr) {
+    uint64_t start = bench_now_ns();
+    a->free(ptr);
+    uint64_t elapsed = bench_now_ns() - start;
+    r->free_ns += elapsed;
+    r->frees++;
+    if(elapsed > r->extra[MAX_FREE_NS]) r->extra[MAX_FREE_NS] = elapsed;
+}
+
+// Records the tree's shape while the pattern's chunks are still around. malloc has no tree to report on.
+static void finish(const bench_allocator *a, bench_result *r) {
+    if(a != &bench_tralloc) return;
+    struct trtree_stats stats;
+    trtree_stats(&stats);
+    r->extra[TREE_MAX_HEIGHT] = stats.max_height;
+    r->extra[TREE_SEARCH_MAX_VISITS] = stats.search_max_visits;
+    r->extra[TREE_ADD_MAX_VISITS] = stats.add_max_visits;
+}
+
+static void print_result(const char *name, const bench_allocator *a, const bench_result *r) {
+    printf("%-12s %-8s", name, a->name);
+    // Some patterns only time one kind of call.
+    if(r->allocs) printf(" %10.1f %10llu", (double)r->alloc_ns / (double)r->allocs, (unsigned long long)r->extra[MAX_ALLOC_NS]);
+    else printf(" %10s %10s", "-", "-");
+    if(r->frees) printf(" %10.1f %10llu", (double)r->free_ns / (double)r->frees, (unsigned long long)r->extra[MAX_FREE_NS]);
+    else printf(" %10s %10s", "-", "-");
+    if(a == &bench_tralloc) {
+        printf(" %7llu %9llu %9llu\n", (unsigned long long)r->extra[TREE_MAX_HEIGHT],
+            (unsigned long long)r->extra[TREE_SEARCH_MAX_VISITS], (unsigned long long)r->extra[TREE_ADD_MAX_VISITS]);
+    } else {
+        printf(" %7s %9s %9s\n", "-", "-", "-");
+    }
+}
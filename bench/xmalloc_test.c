@@ -0,0 +1,196 @@
+/*
+ * Port of xmalloc-test (Lever and Boreham, "malloc() Performance in a Multithreaded Linux Environment") to the
+ * tralloc benchmark harness.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: xmalloc_test [-a allocator] [threads seconds max_size]
+ * Defaults: 4 2 120. The allocator defaults to tralloc-locked.
+ *
+ * The threads form a ring. Each one allocates batches of blocks of random size and passes them to the next thread,
+ * which frees them, so every block is allocated on one thread and freed on another. A thread stops producing while its
+ * neighbour has too many batches queued, so memory stays bounded. Reports frees per second.
+ */
+
+#include "harness.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCH_BLOCKS 64
+#define MAX_QUEUED 16
+
+typedef struct config {
+    size_t threads;
+    uint64_t seconds;
+    size_t max_size;
+} config;
+
+// Allocated with the allocator under test, like the blocks it carries.
+typedef struct batch {
+    struct batch *next;
+    void *blocks[BATCH_BLOCKS];
+} batch;
+
+typedef struct mailbox {
+    pthread_mutex_t lock;
+    batch *head;
+    size_t queued;
+} mailbox;
+
+typedef struct worker_arg {
+    const bench_allocator *allocator;
+    const config *cfg;
+    mailbox *inbox;
+    mailbox *outbox;
+    uint64_t rng;
+} worker_arg;
+
+static bool stop;
+static uint64_t total_frees;
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx);
+static void *worker(void *arg);
+// Frees every batch in the mailbox and returns how many blocks that was.
+static uint64_t drain(const bench_allocator *a, mailbox *m);
+
+int main(int argc, char **argv) {
+    config cfg = { 4, 2, 120 };
+    const bench_allocator *a = &bench_tralloc_locked;
+    int i = 1;
+    if(i + 1 < argc && !strcmp(argv[i], "-a")) {
+        a = bench_find_allocator(argv[i + 1]);
+        i += 2;
+    }
+    if(argc - i == 3) {
+        cfg.threads = strtoull(argv[i], NULL, 10);
+        cfg.seconds = strtoull(argv[i + 1], NULL, 10);
+        cfg.max_size = strtoull(argv[i + 2], NULL, 10);
+    } else if(argc != i) {
+        a = NULL;
+    }
+    if(!a || !cfg.threads || !cfg.seconds || !cfg.max_size) {
+        fprintf(stderr, "usage: xmalloc_test [-a allocator] [threads seconds max_size]\n");
+        return 2;
+    }
+    if(a == &bench_tralloc && cfg.threads > 1) {
+        fprintf(stderr, "xmalloc_test: tralloc isn't thread-safe, use tralloc-locked\n");
+        return 2;
+    }
+    bench_result result;
+    if(bench_run(run, a, &cfg, false, &result)) {
+        fprintf(stderr, "xmalloc_test: run with %s failed\n", a->name);
+        return 1;
+    }
+    printf("%-13s %-14s %3zu threads %14.0f frees/s   heap %10llu\n", "xmalloc-test", a->name, cfg.threads,
+        (double)result.frees / ((double)result.extra[0] / 1e9), (unsigned long long)result.heap_bytes);
+    return 0;
+}
+
+static void run(const bench_allocator *a, bench_result *r, void *ctx) {
+    const config *cfg = ctx;
+    pthread_t *threads = bench_map(cfg->threads * sizeof(pthread_t));
+    mailbox *mailboxes = bench_map(cfg->threads * sizeof(mailbox));
+    worker_arg *args = bench_map(cfg->threads * sizeof(worker_arg));
+    size_t t;
+    for(t = 0; t < cfg->threads; t++) {
+        pthread_mutex_init(&mailboxes[t].lock, NULL);
+        args[t].allocator = a;
+        args[t].cfg = cfg;
+        args[t].inbox = &mailboxes[t];
+        args[t].outbox = &mailboxes[(t + 1) % cfg->threads];
+        args[t].rng = 88172645463325252ULL + t;
+    }
+    uint64_t start = bench_now_ns();
+    for(t = 0; t < cfg->threads; t++) {
+        if(pthread_create(&threads[t], NULL, worker, &args[t])) _exit(1);
+    }
+    sleep(cfg->seconds);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for(t = 0; t < cfg->threads; t++) pthread_join(threads[t], NULL);
+    r->extra[0] = bench_now_ns() - start;
+    r->frees = total_frees;
+    for(t = 0; t < cfg->threads; t++) {
+        drain(a, &mailboxes[t]);
+        pthread_mutex_destroy(&mailboxes[t].lock);
+    }
+    bench_unmap(threads, cfg->threads * sizeof(pthread_t));
+    bench_unmap(mailboxes, cfg->threads * sizeof(mailbox));
+    bench_unmap(args, cfg->threads * sizeof(worker_arg));
+}
+
+static void *worker(void *arg) {
+    worker_arg *w = arg;
+    const bench_allocator *a = w->allocator;
+    uint64_t frees = 0;
+    while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        frees += drain(a, w->inbox);
+        pthread_mutex_lock(&w->outbox->lock);
+        bool full = w->outbox->queued >= MAX_QUEUED;
+        pthread_mutex_unlock(&w->outbox->lock);
+        if(full) {
+            sched_yield();
+            continue;
+        }
+        batch *b = a->alloc(sizeof(batch));
+        size_t i;
+        for(i = 0; i < BATCH_BLOCKS; i++) {
+            size_t size = 1 + bench_rand(&w->rng) % w->cfg->max_size;
+            b->blocks[i] = a->alloc(size);
+            memset(b->blocks[i], 0, size);
+        }
+        pthread_mutex_lock(&w->outbox->lock);
+        b->next = w->outbox->head;
+        w->outbox->head = b;
+        w->outbox->queued++;
+        pthread_mutex_unlock(&w->outbox->lock);
+    }
+    __atomic_add_fetch(&total_frees, frees, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static uint64_t drain(const bench_allocator *a, mailbox *m) {
+    pthread_mutex_lock(&m->lock);
+    batch *b = m->head;
+    m->head = NULL;
+    m->queued = 0;
+    pthread_mutex_unlock(&m->lock);
+    uint64_t frees = 0;
+    while(b) {
+        batch *next = b->next;
+        size_t i;
+        for(i = 0; i < BATCH_BLOCKS; i++) a->free(b->blocks[i]);
+        a->free(b);
+        frees += BATCH_BLOCKS + 1;
+        b = next;
+    }
+    return frees;
+}
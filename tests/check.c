@@ -0,0 +1,260 @@
+/*
+ * Consistency checks for tralloc's bookkeeping, run by make check.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Diffs two snapshots around a known set of frees, retags, resizes and new allocations. Then runs a random sequence of
+ * tralloc, tralloc_tagged (some with tags past TR_TAG_OVERFLOW) and trfree calls, and periodically checks that the heap,
+ * the free tree and every set of counters kept alongside them still agree. Then corrupts a footer and a tree link by hand
+ * and checks that trcheck reports each. Exits non-zero on the first failure.
+ */
+
+#include "../tralloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS 512
+#define STEPS 200000
+#define CHECK_EVERY 1000
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while(0)
+
+typedef struct slot {
+    unsigned char *ptr;
+    size_t size;
+    unsigned char fill;
+} slot;
+
+// Finds a chunk for the corruption checks: the first live one or the first free one, in heap order.
+typedef struct find {
+    int in_use;
+    void *ptr;
+    size_t usable_size;
+} find;
+
+static slot slots[SLOTS];
+
+static void check_heap(void);
+static void check_snapshot_diff(void);
+static int collect_group(const struct trsnapshot_group *group, void *ctx);
+static int find_chunk(void *ptr, size_t usable_size, int in_use, void *ctx);
+static size_t random_size(uint64_t *rng);
+static uint64_t next(uint64_t *rng);
+
+int main(void) {
+    uint64_t rng = 88172645463325252ULL;
+    size_t step, i;
+
+    // Visit counts cover real nodes only. The first search finds an empty tree, and freeing into it visits nothing.
+    struct trtree_stats tree;
+    void *first = tralloc(64);
+    trfree(first);
+    trtree_stats(&tree);
+    CHECK(tree.search_ops == 1 && tree.search_visits == 0);
+    CHECK(tree.add_ops == 1 && tree.add_visits == 0 && tree.max_height == 1);
+
+    check_snapshot_diff();
+
+    for(step = 1; step <= STEPS; step++) {
+        slot *s = &slots[next(&rng) % SLOTS];
+        if(s->ptr) {
+            // Every byte must still be what was written, or some other chunk overlaps this one.
+            for(i = 0; i < s->size; i++) CHECK(s->ptr[i] == s->fill);
+            trfree(s->ptr);
+            s->ptr = NULL;
+        } else {
+            s->size = random_size(&rng);
+            s->fill = (unsigned char)step;
+            unsigned tag = (unsigned)(next(&rng) % (TR_TAGS + 16));
+            s->ptr = next(&rng) % 2 ? tralloc(s->size) : tralloc_tagged(s->size, tag);
+            CHECK(s->ptr);
+            memset(s->ptr, s->fill, s->size);
+        }
+        if(step % CHECK_EVERY == 0) check_heap();
+    }
+
+    // Corrupt a live chunk's footer, and put it back.
+    find live = { 1, NULL, 0 };
+    trheap_walk(find_chunk, &live);
+    CHECK(live.ptr);
+    size_t *footer_size = (size_t *)((char *)live.ptr + live.usable_size);
+    *footer_size += sizeof(void *);
+    CHECK(trcheck() == TRCHECK_FOOTER_MISMATCH);
+    *footer_size -= sizeof(void *);
+    CHECK(trcheck() == TRCHECK_OK);
+
+    // Point a free chunk's parent link partway into its own header, where no chunk starts, and put it back.
+    // The link is the first word of its payload.
+    find free_chunk = { 0, NULL, 0 };
+    trheap_walk(find_chunk, &free_chunk);
+    CHECK(free_chunk.ptr);
+    void **parent = (void **)free_chunk.ptr;
+    void *saved = *parent;
+    *parent = (char *)free_chunk.ptr - sizeof(void *);
+    CHECK(trcheck() == TRCHECK_PARENT_LINK);
+    *parent = saved;
+    CHECK(trcheck() == TRCHECK_OK);
+
+    for(i = 0; i < SLOTS; i++) {
+        if(slots[i].ptr) trfree(slots[i].ptr);
+    }
+    check_heap();
+    printf("check: %d steps, all checks passed\n", STEPS);
+    return 0;
+}
+
+static void check_heap(void) {
+    CHECK(trcheck() == TRCHECK_OK);
+    struct trstats stats;
+    trstats(&stats);
+    struct trwaste waste;
+    trwaste(&waste);
+    CHECK(waste.granted_bytes == stats.bytes_in_use);
+    CHECK(waste.requested_bytes == stats.bytes_requested);
+    CHECK(waste.rounding_bytes + waste.min_size_bytes + waste.unsplit_bytes
+        == waste.granted_bytes - waste.requested_bytes);
+    size_t requested = 0, granted = 0, tagged = 0;
+    int c;
+    unsigned tag;
+    for(c = 0; c < (int)TR_SIZE_CLASSES; c++) {
+        requested += waste.requested_by_class[c];
+        granted += waste.granted_by_class[c];
+    }
+    CHECK(requested == waste.requested_bytes);
+    CHECK(granted == waste.granted_bytes);
+    for(tag = 0; tag < TR_TAGS; tag++) {
+        struct trtag_stats tag_stats;
+        trtag_stats(tag, &tag_stats);
+        tagged += tag_stats.live_bytes;
+    }
+    CHECK(tagged == stats.bytes_in_use);
+}
+
+// Groups reported by one trsnapshot_diff, in call order.
+typedef struct groups {
+    struct trsnapshot_group group[16];
+    int count;
+} groups;
+
+static void check_snapshot_diff(void) {
+    // Runs on a fresh heap, so these are the only live allocations and each free leaves a hole the search finds first.
+    void *freed = tralloc_tagged(100, 10);
+    void *kept = tralloc_tagged(100, 10);
+    void *retagged = tralloc_tagged(200, 10);
+    void *twin = tralloc_tagged(300, 12);
+    void *resized = tralloc_tagged(400, 10);
+    void *spacer = tralloc_tagged(8, 14);
+    struct trsnapshot *before = trsnapshot_take();
+    CHECK(before);
+
+    trfree(freed);
+    // Each replacement is allocated straight after its original is freed, into the hole it left.
+    trfree(retagged);
+    void *retagged_again = tralloc_tagged(200, 11);
+    CHECK(retagged_again == retagged);
+    trfree(twin);
+    void *twin_again = tralloc_tagged(300, 12);
+    CHECK(twin_again == twin);
+    trfree(resized);
+    void *resized_again = tralloc_tagged(392, 10);
+    CHECK(resized_again == resized);
+    void *added = tralloc_tagged(1000, 10);
+    void *added_small = tralloc_tagged(50, 13);
+    struct trsnapshot *after = trsnapshot_take();
+    CHECK(after);
+
+    groups got = { .count = 0 };
+    CHECK(trsnapshot_diff(before, after, collect_group, &got) == 0);
+    // tag, size class, then new, freed and retained as allocations and bytes. Ordered by tag, then size class.
+    struct trsnapshot_group want[] = {
+        // freed is freed and kept retained. resized and its smaller replacement share a size class.
+        { 10, trsize_class(100), 0, 0, 1, 100, 1, 100 },
+        { 10, trsize_class(200), 0, 0, 1, 200, 0, 0 },
+        { 10, trsize_class(400), 1, 392, 1, 400, 0, 0 },
+        { 10, trsize_class(1000), 1, 1000, 0, 0, 0, 0 },
+        { 11, trsize_class(200), 1, 200, 0, 0, 0, 0 },
+        // An identical twin at the same address reads as retained.
+        { 12, trsize_class(300), 0, 0, 0, 0, 1, 300 },
+        { 13, trsize_class(50), 1, 50, 0, 0, 0, 0 },
+        { 14, trsize_class(8), 0, 0, 0, 0, 1, 8 },
+    };
+    int i, count = (int)(sizeof(want) / sizeof(want[0]));
+    CHECK(got.count == count);
+    for(i = 0; i < count; i++) {
+        struct trsnapshot_group *g = &got.group[i], *w = &want[i];
+        CHECK(g->tag == w->tag && g->size_class == w->size_class);
+        CHECK(g->new_allocs == w->new_allocs && g->new_bytes == w->new_bytes);
+        CHECK(g->freed_allocs == w->freed_allocs && g->freed_bytes == w->freed_bytes);
+        CHECK(g->retained_allocs == w->retained_allocs && g->retained_bytes == w->retained_bytes);
+    }
+
+    trsnapshot_release(before);
+    trsnapshot_release(after);
+    trfree(kept);
+    trfree(retagged_again);
+    trfree(twin_again);
+    trfree(resized_again);
+    trfree(added);
+    trfree(added_small);
+    trfree(spacer);
+}
+
+static int collect_group(const struct trsnapshot_group *group, void *ctx) {
+    groups *got = (groups *)ctx;
+    if(got->count == (int)(sizeof(got->group) / sizeof(got->group[0]))) return 1;
+    got->group[got->count++] = *group;
+    return 0;
+}
+
+static int find_chunk(void *ptr, size_t usable_size, int in_use, void *ctx) {
+    find *f = ctx;
+    if(in_use != f->in_use) return 0;
+    f->ptr = ptr;
+    f->usable_size = usable_size;
+    return 1;
+}
+
+// Mostly small, with the occasional large request so that chunks get split and coalesced.
+static size_t random_size(uint64_t *rng) {
+    uint64_t r = next(rng);
+    if(r % 64 == 0) return 4096 + (size_t)(r >> 8) % 65536;
+    return 1 + (size_t)(r >> 8) % 512;
+}
+
+static uint64_t next(uint64_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
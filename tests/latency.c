@@ -0,0 +1,89 @@
+/*
+ * Checks for the latency histogram's percentile math, run by make check.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Feeds known durations straight into the latency histogram and checks the percentiles trlatency would report. Real
+ * timings can't be controlled, so this builds tralloc.c into the test to reach latency_record and latency_summarize.
+ * Exits non-zero on the first failure.
+ */
+
+#include "../tralloc.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while(0)
+
+static latency_hist hist;
+
+int main(void) {
+    struct trlatency out;
+    uint64_t ns;
+
+    // An empty histogram reports zeros across the board.
+    latency_summarize(&hist, &out);
+    CHECK(out.count == 0 && out.p50_ns == 0 && out.p99_ns == 0 && out.p999_ns == 0 && out.max_ns == 0);
+
+    // Below 1 << LATENCY_SUB_BITS every value has its own bucket, so percentiles are exact.
+    for(ns = 0; ns < 10; ns++) latency_record(&hist, 7);
+    latency_summarize(&hist, &out);
+    CHECK(out.count == 10 && out.p50_ns == 7 && out.p99_ns == 7 && out.p999_ns == 7 && out.max_ns == 7);
+
+    // 1 to 1000 once each. Ranks 500, 990 and 999 land in buckets 496-503, 976-991 and 992-1007. The last is capped at max.
+    memset(&hist, 0, sizeof(hist));
+    for(ns = 1; ns <= 1000; ns++) latency_record(&hist, ns);
+    latency_summarize(&hist, &out);
+    CHECK(out.count == 1000);
+    CHECK(out.p50_ns == 503);
+    CHECK(out.p99_ns == 991);
+    CHECK(out.p999_ns == 1000);
+    CHECK(out.max_ns == 1000);
+
+    // One slow outlier among 99 fast calls is rank 100 of 100. p99 is rank 99, so only p999 sees it.
+    memset(&hist, 0, sizeof(hist));
+    for(ns = 0; ns < 99; ns++) latency_record(&hist, 20);
+    latency_record(&hist, 5000000);
+    latency_summarize(&hist, &out);
+    CHECK(out.p50_ns == 20);
+    CHECK(out.p99_ns == 20);
+    CHECK(out.p999_ns == 5000000);
+
+    // The top bucket's upper edge wraps past UINT64_MAX, and the max still caps it.
+    memset(&hist, 0, sizeof(hist));
+    latency_record(&hist, UINT64_MAX);
+    latency_summarize(&hist, &out);
+    CHECK(out.count == 1 && out.p50_ns == UINT64_MAX && out.max_ns == UINT64_MAX);
+
+    printf("latency: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Offline analyzer for heaps dumped with trdump.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trdump_analyze [dump-file]
+ * Reads a dump written by trdump (stdin if no file is given) and reports fragmentation, the free size distribution and the
+ * shape of the free tree.
+ */
+
+#include "../tralloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+static struct trdump_chunk *chunks = NULL;
+static size_t chunk_count = 0;
+
+static bool read_dump(FILE *f, struct trdump_header *dump_header);
+static struct trdump_chunk *find_chunk(uint64_t addr);
+static inline int floor_log2(uint64_t input);
+
+int main(int argc, char **argv) {
+    FILE *f = stdin;
+    if(argc > 1 && !(f = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct trdump_header dump_header;
+    if(!read_dump(f, &dump_header)) {
+        fprintf(stderr, "trdump_analyze: not a trdump file\n");
+        return 1;
+    }
+
+    // Layout and fragmentation
+    uint64_t live_chunks = 0, live_bytes = 0, free_chunks = 0, free_bytes = 0, largest_free = 0, adjacent_free = 0;
+    uint64_t free_hist[64] = { 0 };
+    uint64_t tag_chunks[TR_TAGS] = { 0 }, tag_bytes[TR_TAGS] = { 0 };
+    size_t i;
+    for(i = 0; i < chunk_count; i++) {
+        struct trdump_chunk *chunk = &chunks[i];
+        if(chunk->in_use) {
+            live_chunks++;
+            live_bytes += chunk->size;
+            if(chunk->tag < TR_TAGS) {
+                tag_chunks[chunk->tag]++;
+                tag_bytes[chunk->tag] += chunk->size;
+            }
+            continue;
+        }
+        free_chunks++;
+        free_bytes += chunk->size;
+        if(chunk->size > largest_free) largest_free = chunk->size;
+        free_hist[floor_log2(chunk->size)]++;
+        if(i && !chunks[i - 1].in_use) adjacent_free++;
+    }
+    uint64_t heap_size = dump_header.guard_addr - dump_header.first_chunk;
+    printf("heap_size: %llu\n", (unsigned long long)heap_size);
+    printf("chunks: %llu\n", (unsigned long long)chunk_count);
+    printf("live: %llu chunks, %llu bytes\n", (unsigned long long)live_chunks, (unsigned long long)live_bytes);
+    printf("free: %llu chunks, %llu bytes\n", (unsigned long long)free_chunks, (unsigned long long)free_bytes);
+    printf("overhead: %llu bytes\n", (unsigned long long)(heap_size - live_bytes - free_bytes));
+    printf("largest_free: %llu\n", (unsigned long long)largest_free);
+    printf("fragmentation: %.4f\n", free_bytes ? 1.0 - (double)largest_free / (double)free_bytes : 0.0);
+    if(adjacent_free) printf("adjacent_free_pairs: %llu (should be 0)\n", (unsigned long long)adjacent_free);
+
+    printf("live by tag:\n");
+    int b;
+    for(b = 0; b < TR_TAGS; b++) {
+        if(!tag_chunks[b]) continue;
+        printf("    %d: %llu chunks, %llu bytes\n", b, (unsigned long long)tag_chunks[b], (unsigned long long)tag_bytes[b]);
+    }
+
+    printf("free size distribution:\n");
+    for(b = 0; b < 64; b++) {
+        if(!free_hist[b]) continue;
+        printf("    [%llu, %llu): %llu\n", 1ULL << b, b == 63 ? ~0ULL : 1ULL << (b + 1), (unsigned long long)free_hist[b]);
+    }
+
+    // Tree shape. Walk breadth first so degenerate trees don't blow the stack.
+    uint64_t nodes = 0, leaves = 0, one_child = 0, depth_sum = 0, height = 0, broken_links = 0;
+    struct trdump_chunk **queue = malloc((free_chunks + 1) * sizeof(*queue));
+    uint64_t *depths = malloc((free_chunks + 1) * sizeof(*depths));
+    size_t head = 0, tail = 0;
+    struct trdump_chunk *root = dump_header.tree_root ? find_chunk(dump_header.tree_root) : NULL;
+    if(dump_header.tree_root && !root) broken_links++;
+    if(root) {
+        queue[tail] = root;
+        depths[tail++] = 1;
+    }
+    while(head < tail) {
+        struct trdump_chunk *cur = queue[head];
+        uint64_t depth = depths[head++];
+        nodes++;
+        depth_sum += depth;
+        if(depth > height) height = depth;
+        int children = 0;
+        uint64_t links[2] = { cur->left, cur->right };
+        int l;
+        for(l = 0; l < 2; l++) {
+            if(!links[l]) continue;
+            struct trdump_chunk *child = find_chunk(links[l]);
+            // A chunk that isn't free, points elsewhere, or would overflow the queue means the tree is corrupt.
+            if(!child || child->in_use || child->parent != cur->addr || tail > free_chunks) {
+                broken_links++;
+                continue;
+            }
+            children++;
+            queue[tail] = child;
+            depths[tail++] = depth + 1;
+        }
+        if(!children) leaves++;
+        else if(children == 1) one_child++;
+    }
+    printf("tree:\n");
+    printf("    nodes: %llu\n", (unsigned long long)nodes);
+    printf("    height: %llu (minimum possible %d)\n", (unsigned long long)height, nodes ? floor_log2(nodes) + 1 : 0);
+    printf("    average_depth: %.2f\n", nodes ? (double)depth_sum / (double)nodes : 0.0);
+    printf("    leaves: %llu\n", (unsigned long long)leaves);
+    printf("    one_child: %llu\n", (unsigned long long)one_child);
+    if(nodes != free_chunks) printf("    free chunks not in tree: %lld\n", (long long)(free_chunks - nodes));
+    if(broken_links) printf("    broken_links: %llu\n", (unsigned long long)broken_links);
+    free(queue);
+    free(depths);
+    free(chunks);
+    return 0;
+}
+
+static bool read_dump(FILE *f, struct trdump_header *dump_header) {
+    if(fread(dump_header, sizeof(*dump_header), 1, f) != 1) return false;
+    if(memcmp(dump_header->magic, TRDUMP_MAGIC, sizeof(TRDUMP_MAGIC))) return false;
+    size_t capacity = 1024;
+    chunks = malloc(capacity * sizeof(*chunks));
+    while(fread(&chunks[chunk_count], sizeof(*chunks), 1, f) == 1) {
+        if(++chunk_count == capacity) {
+            capacity *= 2;
+            chunks = realloc(chunks, capacity * sizeof(*chunks));
+        }
+    }
+    return true;
+}
+
+// Chunks are dumped in address order, so a binary search finds them.
+static struct trdump_chunk *find_chunk(uint64_t addr) {
+    size_t low = 0, high = chunk_count;
+    while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(chunks[mid].addr < addr) low = mid + 1;
+        else high = mid;
+    }
+    return low < chunk_count && chunks[low].addr == addr ? &chunks[low] : NULL;
+}
+
+static inline int floor_log2(uint64_t input) {
+    int log = 0;
+    while(input >>= 1) log++;
+    return log;
+}
@@ -0,0 +1,256 @@
+/*
+ * Replays allocation traces recorded with trtrace against tralloc or the system malloc.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trreplay [-m] trace-file
+ * Replays the allocations and frees of a trace written by trtrace_start, in order and on one thread, and reports the total
+ * time, the latency distribution of each op, the peak heap size and the final fragmentation. With -m the trace is replayed
+ * against the system malloc instead of tralloc.
+ *
+ * The total time is the sum of the timed calls, so the bookkeeping between them costs neither allocator anything. malloc
+ * can't report its largest free chunk, so its fragmentation is n/a. Its heap size comes from mallinfo2, which walks the
+ * arena, so the peak is sampled every MALLINFO_EVERY events instead of after each one.
+ *
+ * Everything the replay needs is mapped up front. glibc's malloc also moves the program break, so calling it while tralloc
+ * is growing the heap would break tralloc's assumption that its sbrk calls are contiguous.
+ */
+
+#include "../tralloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define MALLINFO_EVERY 64
+#define SUB_BITS 5
+#define BUCKETS ((1 << SUB_BITS) * (64 - SUB_BITS + 1))
+
+typedef struct histogram {
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram;
+
+// Maps addresses from the trace to the pointers handed out during the replay.
+typedef struct slot {
+    uint64_t traced;
+    void *replayed;
+} slot;
+
+static slot *slots = NULL;
+static size_t slot_mask = 0;
+static histogram alloc_hist;
+static histogram free_hist;
+
+static slot *find_slot(uint64_t traced);
+static void remove_slot(slot *s);
+static inline uint64_t now_ns(void);
+static void record(histogram *hist, uint64_t ns);
+static size_t heap_bytes(bool use_malloc);
+static void print_histogram(const char *name, histogram *hist);
+static inline int bucket(uint64_t value);
+static inline uint64_t bucket_min(int index);
+static void *map(size_t len);
+
+int main(int argc, char **argv) {
+    bool use_malloc = argc > 2 && !strcmp(argv[1], "-m");
+    if(argc != 2 + use_malloc) {
+        fprintf(stderr, "usage: trreplay [-m] trace-file\n");
+        return 2;
+    }
+    const char *path = argv[argc - 1];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        return 1;
+    }
+    if((size_t)st.st_size < sizeof(struct trtrace_header)) {
+        fprintf(stderr, "trreplay: %s is not a trtrace file\n", path);
+        return 1;
+    }
+    char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(file == MAP_FAILED || memcmp(file, TRTRACE_MAGIC, sizeof(TRTRACE_MAGIC))) {
+        fprintf(stderr, "trreplay: %s is not a trtrace file\n", path);
+        return 1;
+    }
+    const struct trtrace_event *events = (const struct trtrace_event *)(file + sizeof(struct trtrace_header));
+    size_t event_count = (st.st_size - sizeof(struct trtrace_header)) / sizeof(struct trtrace_event);
+
+    // At most every event is a live allocation. Keep the table at most half full.
+    size_t capacity = 16;
+    while(capacity < event_count * 2) capacity *= 2;
+    slots = map(capacity * sizeof(slot));
+    slot_mask = capacity - 1;
+
+    size_t allocs = 0, frees = 0, unknown_frees = 0, peak_heap = 0;
+    size_t i;
+    for(i = 0; i < event_count; i++) {
+        const struct trtrace_event *event = &events[i];
+        slot *s = find_slot(event->ptr);
+        if(event->op == TRTRACE_ALLOC) {
+            uint64_t op_start = now_ns();
+            void *p = use_malloc ? malloc(event->size) : tralloc(event->size);
+            record(&alloc_hist, now_ns() - op_start);
+            // Touch the memory like the traced program would have.
+            if(event->size) *(char *)p = 0;
+            s->traced = event->ptr;
+            s->replayed = p;
+            allocs++;
+        } else if(event->op == TRTRACE_FREE) {
+            if(!s->replayed) {
+                // Allocated before the trace started.
+                unknown_frees++;
+                continue;
+            }
+            uint64_t op_start = now_ns();
+            if(use_malloc) free(s->replayed);
+            else trfree(s->replayed);
+            record(&free_hist, now_ns() - op_start);
+            remove_slot(s);
+            frees++;
+        }
+        if(!use_malloc || i % MALLINFO_EVERY == 0) {
+            size_t heap = heap_bytes(use_malloc);
+            if(heap > peak_heap) peak_heap = heap;
+        }
+    }
+    size_t final_heap = heap_bytes(use_malloc);
+    if(final_heap > peak_heap) peak_heap = final_heap;
+    uint64_t total = alloc_hist.sum + free_hist.sum;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("allocator: %s\n", use_malloc ? "malloc" : "tralloc");
+    printf("events: %zu (%zu allocs, %zu frees, %zu frees of pointers from before the trace)\n", event_count, allocs, frees, unknown_frees);
+    printf("total_time_ms: %.3f\n", (double)total / 1e6);
+    print_histogram("alloc", &alloc_hist);
+    print_histogram("free", &free_hist);
+    printf("peak_heap_bytes: %zu\n", peak_heap);
+    printf("final_heap_bytes: %zu\n", final_heap);
+    if(use_malloc) {
+        struct mallinfo2 info = mallinfo2();
+        printf("final_free_bytes: %zu\n", info.fordblks);
+        printf("final_fragmentation: n/a\n");
+    } else {
+        struct trstats stats;
+        trstats(&stats);
+        printf("final_free_bytes: %zu\n", stats.bytes_free);
+        printf("final_fragmentation: %.4f\n", stats.fragmentation);
+    }
+    printf("max_rss_kb: %ld\n", usage.ru_maxrss);
+    return 0;
+}
+
+static slot *find_slot(uint64_t traced) {
+    size_t i = (size_t)((traced >> 4) * 0x9e3779b97f4a7c15ULL) & slot_mask;
+    while(slots[i].replayed && slots[i].traced != traced) i = (i + 1) & slot_mask;
+    return &slots[i];
+}
+
+// Backward shift deletion, so lookups never need tombstones.
+static void remove_slot(slot *s) {
+    size_t hole = (size_t)(s - slots), i = hole;
+    while(true) {
+        i = (i + 1) & slot_mask;
+        if(!slots[i].replayed) break;
+        size_t home = (size_t)((slots[i].traced >> 4) * 0x9e3779b97f4a7c15ULL) & slot_mask;
+        // Move the entry into the hole unless its home lies cyclically in (hole, i].
+        if(((i - home) & slot_mask) >= ((i - hole) & slot_mask)) {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole].replayed = NULL;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void record(histogram *hist, uint64_t ns) {
+    hist->counts[bucket(ns)]++;
+    hist->total++;
+    hist->sum += ns;
+    if(ns > hist->max) hist->max = ns;
+}
+
+static size_t heap_bytes(bool use_malloc) {
+    if(use_malloc) {
+        struct mallinfo2 info = mallinfo2();
+        return info.arena + info.hblkhd;
+    }
+    struct trstats stats;
+    trstats(&stats);
+    return stats.heap_size;
+}
+
+static void print_histogram(const char *name, histogram *hist) {
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    printf("%s: count %llu, mean %.1f ns", name, (unsigned long long)hist->total, hist->total ? (double)hist->sum / (double)hist->total : 0.0);
+    uint64_t seen = 0;
+    int b = 0, q;
+    for(q = 0; q < 4 && hist->total; q++) {
+        uint64_t rank = (uint64_t)(quantiles[q] * (double)hist->total + 0.5);
+        if(!rank) rank = 1;
+        while(seen + hist->counts[b] < rank) seen += hist->counts[b++];
+        uint64_t upper = bucket_min(b + 1) - 1;
+        printf(", p%g %llu ns", quantiles[q] * 100, (unsigned long long)(upper < hist->max ? upper : hist->max));
+    }
+    printf(", max %llu ns\n", (unsigned long long)hist->max);
+}
+
+static inline int bucket(uint64_t value) {
+    if(value < (1 << SUB_BITS)) return (int)value;
+    int log = 63 - __builtin_clzll(value);
+    return ((log - SUB_BITS + 1) << SUB_BITS) + (int)((value >> (log - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+static inline uint64_t bucket_min(int index) {
+    if(index < (1 << SUB_BITS)) return (uint64_t)index;
+    return ((uint64_t)(1 << SUB_BITS) + (index & ((1 << SUB_BITS) - 1))) << ((index >> SUB_BITS) - 1);
+}
+
+static void *map(size_t len) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
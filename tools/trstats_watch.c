@@ -0,0 +1,116 @@
+/*
+ * Reads the stats page published by trstats_publish from outside the allocating process.
+ * 
+ * Copyright 2017 Simon Swenson. All rights reserved.
+ * 
+ * License: BSD License
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the organization nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: trstats_watch page-file [interval-seconds]
+ * Prints the published counters once, or once per interval until interrupted. The watched process is never paused or
+ * signalled; the page is only read.
+ */
+
+#include "../tralloc.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Attempts at a consistent copy before giving up on the writer, with READ_PAUSE_US between attempts that find it mid-update.
+// An update takes well under a microsecond, so running out means the writer died or stopped partway through one.
+#define READ_TRIES 1000
+#define READ_PAUSE_US 1000
+
+// Takes a consistent copy of the page, retrying while the writer is mid-update. Returns false if the page stays stale.
+static bool read_page(const volatile struct trstats_page *page, struct trstats_page *out);
+
+int main(int argc, char **argv) {
+    if(argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: trstats_watch page-file [interval-seconds]\n");
+        return 2;
+    }
+    unsigned interval = argc > 2 ? (unsigned)atoi(argv[2]) : 0;
+    int fd = open(argv[1], O_RDONLY);
+    if(fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    // A file trstats_publish has only just created may not be sized yet. Touching a page past the end of the file would
+    // raise SIGBUS. Once sized, trstats_publish never shrinks it below a page.
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(struct trstats_page)) {
+        fprintf(stderr, "trstats_watch: %s is not a trstats page\n", argv[1]);
+        close(fd);
+        return 1;
+    }
+    const struct trstats_page *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(page == MAP_FAILED || memcmp(page->magic, TRSTATS_PAGE_MAGIC, sizeof(TRSTATS_PAGE_MAGIC))) {
+        fprintf(stderr, "trstats_watch: %s is not a trstats page\n", argv[1]);
+        return 1;
+    }
+    if(page->version != TRSTATS_PAGE_VERSION) {
+        fprintf(stderr, "trstats_watch: %s has page version %u, expected %u\n", argv[1], page->version,
+            TRSTATS_PAGE_VERSION);
+        return 1;
+    }
+    printf("%8s %14s %14s %14s %10s %12s %12s %12s %8s\n",
+        "pid", "heap", "in_use", "free", "free_cnt", "allocs", "frees", "os_calls", "frag");
+    while(true) {
+        struct trstats_page copy;
+        if(!read_page(page, &copy)) {
+            fprintf(stderr, "trstats_watch: %s is stale; its writer stopped partway through an update\n", argv[1]);
+            if(!interval) return 1;
+            sleep(interval);
+            continue;
+        }
+        printf("%8u %14llu %14llu %14llu %10llu %12llu %12llu %12llu %8.4f\n", copy.pid,
+            (unsigned long long)copy.heap_size, (unsigned long long)copy.bytes_in_use, (unsigned long long)copy.bytes_free,
+            (unsigned long long)copy.free_chunks, (unsigned long long)copy.allocs, (unsigned long long)copy.frees,
+            (unsigned long long)copy.os_calls, copy.fragmentation);
+        fflush(stdout);
+        if(!interval) break;
+        sleep(interval);
+    }
+    return 0;
+}
+
+static bool read_page(const volatile struct trstats_page *page, struct trstats_page *out) {
+    int tries;
+    for(tries = 0; tries < READ_TRIES; tries++) {
+        uint64_t before = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if(!(before & 1)) {
+            memcpy(out, (const void *)page, sizeof(*out));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == before) return true;
+        }
+        usleep(READ_PAUSE_US);
+    }
+    return false;
+}
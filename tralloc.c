@@ -30,11 +30,38 @@
 #include "tralloc.h"
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+// USDT probes. The probe site is a single nop until a tracer attaches.
+#if !defined(TRALLOC_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a) STAP_PROBE1(tralloc, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(tralloc, name, a, b)
+#endif
+#endif
+#ifndef PROBE1
+#define PROBE1(name, a) do {} while(0)
+#define PROBE2(name, a, b) do {} while(0)
+#endif
 
 // Struct definitions
 typedef struct header {
     size_t size;
     bool in_use;
+    // Tag of a live chunk. See tralloc_tagged.
+    unsigned char tag;
+    // Bytes granted beyond what the caller asked for. Only meaningful while in_use. Fits in the header's padding.
+    unsigned short slack;
+    // One plus the index of the allocation's stack in the sample table if it was sampled, 0 otherwise.
+    unsigned int sample;
 } header;
 
 typedef struct node {
@@ -47,6 +74,64 @@ typedef struct footer {
     size_t size;
 } footer;
 
+#define SAMPLE_MAX_DEPTH 32
+// Must be a power of two.
+#define SAMPLE_STACKS 4096
+
+// Log-linear buckets with 32 sub-buckets per power of two, in the style of an HDR histogram.
+#define LATENCY_SUB_BITS 5
+#define LATENCY_BUCKETS ((1 << LATENCY_SUB_BITS) * (64 - LATENCY_SUB_BITS + 1))
+
+typedef struct latency_hist {
+    size_t counts[LATENCY_BUCKETS];
+    size_t total;
+    uint64_t max;
+} latency_hist;
+
+#define TRACE_EVENTS 16384
+#define SLOW_EVENTS 64
+
+typedef struct sample_stack {
+    uint64_t hash;
+    int depth;
+    void *frames[SAMPLE_MAX_DEPTH];
+    size_t live_objs;
+    size_t live_bytes;
+    size_t alloc_objs;
+    size_t alloc_bytes;
+} sample_stack;
+
+typedef struct snapshot_entry {
+    uintptr_t addr;
+    size_t size;
+    unsigned tag;
+} snapshot_entry;
+
+typedef enum diff_kind { DIFF_NEW, DIFF_FREED, DIFF_RETAINED } diff_kind;
+
+struct trsnapshot {
+    size_t mapped_bytes;
+    size_t count;
+    snapshot_entry entries[];
+};
+
+// Batches small writes to a file descriptor so dumps need neither stdio nor the heap.
+typedef struct writer {
+    int fd;
+    int error;
+    size_t len;
+    char buf[4096];
+} writer;
+
+// Accumulates the heatmap bucket currently being streamed out.
+typedef struct heatmap {
+    writer *w;
+    uintptr_t base;
+    size_t bucket_size;
+    size_t index;
+    struct trheatmap_bucket cur;
+} heatmap;
+
 // Function prototypes
 static inline node *header_to_node(header *input);
 static inline footer *header_to_footer(header *input);
@@ -55,6 +140,34 @@ static inline footer *node_to_footer(node *input);
 static inline header *footer_to_header(footer *input);
 static inline node *footer_to_node(footer *input);
 static inline size_t ceil_size(size_t input, size_t offset);
+static inline int floor_log2(uint64_t input);
+// Buckets by power of two, with each power of two split into 1 << sub_bits linear sub-buckets.
+static inline int log_linear_bucket(uint64_t value, int sub_bits);
+static inline uint64_t log_linear_min(int bucket, int sub_bits);
+
+// The allocator proper. tralloc and trfree wrap these with instrumentation.
+static void *alloc_chunk(size_t size, unsigned char tag);
+static void free_chunk(void *to_free);
+// Shared body of tralloc and tralloc_tagged. caller is the public entry point's return address.
+static inline void *alloc_tagged(size_t size, unsigned tag, void *caller);
+
+static inline uint64_t now_ns(void);
+
+// Every memory call to the OS goes through these, so trsyscalls sees it. os_map maps fd shared, or anonymous memory if fd
+// is -1, and returns NULL on failure.
+static void *os_sbrk(size_t bytes);
+static void *os_map(size_t bytes, int fd);
+static void os_unmap(void *addr, size_t bytes);
+
+// Refreshes the published stats page. Only called while one is mapped.
+static void publish_stats(void);
+static void latency_record(latency_hist *hist, uint64_t ns);
+static void latency_summarize(latency_hist *hist, struct trlatency *out);
+static inline void update_instrumented(void);
+
+static void trace_record(uint8_t op, void *ptr, size_t size, uint64_t timestamp);
+static void slow_record(uint32_t op, void *ptr, size_t size, uint64_t timestamp, uint64_t duration, bool grew_heap);
+static int trace_flush(void);
 
 static header *add_chunk(header *tree, header *to_add, header* parent_chunk);
 // Will find a node that's an equal size or larger than the given size, then remove it.
@@ -69,6 +182,46 @@ static header *find_largest(header *tree);
 // It is assumed that tree is not NULL.
 static header *find_smallest(header *tree);
 
+// Returns the chunk after the given one in memory, or NULL if it is the last.
+static inline header *next_chunk(header *chunk);
+// Moves the heatmap forward to the bucket holding addr, writing out every bucket it passes.
+static void heatmap_seek(heatmap *h, uintptr_t addr);
+// Adds the payload in [start, end) to the buckets it covers. Free payload in [release_start, release_end) can be released.
+static void heatmap_span(heatmap *h, uintptr_t start, uintptr_t end, bool live, uintptr_t release_start, uintptr_t release_end);
+// Adds an allocation to the new, freed or retained counts of its group.
+static inline void diff_count(struct trsnapshot_group *groups, const snapshot_entry *entry, diff_kind kind);
+// Counts the resident bytes in the page-aligned range [start, end). Returns -1 if mincore fails.
+static int count_resident(uintptr_t start, uintptr_t end, size_t *resident);
+// Sums the dirty bytes of the smaps entries that overlap [start, end).
+static size_t count_mapping_dirty(uintptr_t start, uintptr_t end);
+// Checks that a tree link leads to a plausible free chunk whose parent link points back. Returns a trcheck_result.
+static int check_tree_link(header *child, header *parent);
+
+static void sample_allocation(header *chunk, size_t requested);
+static void unsample_allocation(header *chunk);
+static size_t next_sample_interval(void);
+// The first backtrace loads the unwinder, which allocates. Call this before capturing stacks from inside tralloc.
+static void warm_up_backtrace(void);
+
+// Returns 0 on success, or -1 on a write error.
+static int write_all(int fd, const void *data, size_t len);
+static void writer_flush(writer *w);
+static void writer_put(writer *w, const void *data, size_t len);
+static void writer_printf(writer *w, const char *format, ...);
+
+// Bookkeeping for trstats, trsize_hist and trwaste as a chunk goes into or out of use.
+static inline void note_allocated(header *chunk, size_t requested);
+static inline void note_freed(header *chunk);
+// Adds or removes an allocation's share of the trwaste counters.
+static inline void note_waste(size_t requested, size_t granted, int size_class, bool add);
+
+// Bookkeeping for trstats and trtree_stats. Call after the chunk has been added to or removed from the tree.
+static inline void note_free_added(header *chunk);
+static inline void note_free_removed(header *chunk);
+// Folds tree_visits into the counters of the operation that just finished, and returns the real nodes it visited.
+static inline size_t note_tree_op(size_t *ops, size_t *visits, size_t *max_visits);
+
+static int fprint_chunk(void *ptr, size_t usable_size, int in_use, void *ctx);
 static void fprint_tree(FILE *f, header *tree, int depth);
 static inline void fprint_depth_padding(FILE *f, int depth);
 
@@ -85,7 +238,106 @@ static bool equals_alternator = false;
 // Deciding whether we take the successor or predecessor in find_replacement
 static bool succ_pred_alternator = false;
 
-void *tralloc(size_t size) {
+// Running totals behind trstats.
+static size_t requested_bytes = 0;
+static size_t in_use_bytes = 0;
+static size_t free_bytes = 0;
+static size_t free_chunks = 0;
+static size_t largest_free = 0;
+static struct trsyscalls syscalls;
+static size_t alloc_counts[TR_SIZE_CLASSES];
+static size_t free_counts[TR_SIZE_CLASSES];
+static size_t live_chunks = 0;
+static size_t total_allocs = 0;
+static size_t total_frees = 0;
+static struct trtag_stats tag_stats[TR_TAGS];
+static size_t rounding_bytes = 0;
+static size_t min_size_bytes = 0;
+static size_t unsplit_bytes = 0;
+static size_t requested_by_class[TR_SIZE_CLASSES];
+static size_t granted_by_class[TR_SIZE_CLASSES];
+
+// Free tree telemetry. tree_visits counts the nodes touched by the insertion or search in progress, and call_visits the
+// nodes touched by the instrumented tralloc or trfree call in progress.
+static size_t tree_visits = 0;
+static size_t call_visits = 0;
+static size_t add_ops = 0;
+static size_t add_visits = 0;
+static size_t add_max_visits = 0;
+static size_t search_ops = 0;
+static size_t search_visits = 0;
+static size_t search_max_visits = 0;
+static size_t max_tree_height = 0;
+
+// Whether tralloc and trfree need to do anything besides allocate. Keeps the uninstrumented path to one branch.
+static bool instrumented = false;
+static bool latency_enabled = false;
+static latency_hist alloc_latency;
+static latency_hist free_latency;
+
+// Trace recorder state. The event buffer is mapped straight from the OS.
+static struct trtrace_event *trace_events = NULL;
+static size_t trace_len = 0;
+static int trace_fd = -1;
+static bool trace_error = false;
+static uint64_t trace_start_ns = 0;
+static _Thread_local uint32_t trace_thread = 0;
+
+// The page trstats_publish mapped from its file, or NULL if stats aren't being published.
+static struct trstats_page *stats_page = NULL;
+
+// Ring buffer of calls slower than slow_threshold_ns.
+static uint64_t slow_threshold_ns = 0;
+static struct trslow_event slow_events[SLOW_EVENTS];
+static size_t slow_total = 0;
+
+// Sampling profiler state. The table is mapped straight from the OS on first use.
+static sample_stack *sample_stacks = NULL;
+static size_t sample_period = 0;
+// The period live samples were taken at. Survives trsample_start(0), since pprof needs it to unsample those objects.
+static size_t last_sample_period = 0;
+static size_t bytes_until_sample = 0;
+static uint64_t sample_rng = 0x9e3779b97f4a7c15ULL;
+// Return address of the tralloc call being sampled. Stacks are trimmed to start there, so tralloc's own frames never show up.
+static void *sample_caller = NULL;
+
+void *tralloc(size_t size) { return alloc_tagged(size, 0, __builtin_return_address(0)); }
+
+void *tralloc_tagged(size_t size, unsigned tag) { return alloc_tagged(size, tag, __builtin_return_address(0)); }
+
+static inline void *alloc_tagged(size_t size, unsigned tag, void *caller) {
+    if(tag > TR_TAG_OVERFLOW) tag = TR_TAG_OVERFLOW;
+    if(sample_period) sample_caller = caller;
+    if(!instrumented) return alloc_chunk(size, (unsigned char)tag);
+    size_t sbrk_calls = syscalls.sbrk.calls;
+    call_visits = 0;
+    uint64_t start = now_ns();
+    void *result = alloc_chunk(size, (unsigned char)tag);
+    uint64_t duration = now_ns() - start;
+    if(latency_enabled) latency_record(&alloc_latency, duration);
+    if(slow_threshold_ns && duration >= slow_threshold_ns)
+        slow_record(TRTRACE_ALLOC, result, size, start, duration, syscalls.sbrk.calls != sbrk_calls);
+    if(trace_fd >= 0) trace_record(TRTRACE_ALLOC, result, size, start);
+    return result;
+}
+
+void trfree(void *to_free) {
+    if(!instrumented) {
+        free_chunk(to_free);
+        return;
+    }
+    call_visits = 0;
+    uint64_t start = now_ns();
+    free_chunk(to_free);
+    uint64_t duration = now_ns() - start;
+    if(latency_enabled) latency_record(&free_latency, duration);
+    if(slow_threshold_ns && duration >= slow_threshold_ns) slow_record(TRTRACE_FREE, to_free, 0, start, duration, false);
+    if(trace_fd >= 0) trace_record(TRTRACE_FREE, to_free, 0, start);
+}
+
+static void *alloc_chunk(size_t size, unsigned char tag) {
+    size_t requested = size;
+    PROBE1(alloc_entry, size);
     // init globals
     if(!header_pad)
         header_pad = ceil_size(sizeof(header), sizeof(intptr_t));
@@ -94,7 +346,7 @@ void *tralloc(size_t size) {
     if(!node_pad)
         node_pad = ceil_size(sizeof(node), sizeof(intptr_t));
     if(!fake_root) {
-        fake_root = (header *)sbrk(header_pad + node_pad);
+        fake_root = (header *)os_sbrk(header_pad + node_pad);
         fake_root->size = 0;
         fake_root->in_use = false;
         node *fake_root_node = header_to_node(fake_root);
@@ -109,37 +361,62 @@ void *tralloc(size_t size) {
 
     // Try to find a node already in the tree
     header *found = remove_chunk_by_size(fake_root, size);
+    note_tree_op(&search_ops, &search_visits, &search_max_visits);
     if(!found) {
         // Need to allocate for another chunk.
-        found = (header *)sbrk(header_pad + size + footer_pad);
+        found = (header *)os_sbrk(header_pad + size + footer_pad);
         if(!first_chunk) first_chunk = (void *)found;
         guard_addr = (void *)((char *)found + header_pad + size + footer_pad);
         found->size = size;
         header_to_footer(found)->size = size;
-    } else if(found->size >= size + footer_pad + header_pad + node_pad) {
+    } else {
+        note_free_removed(found);
+    }
+    if(found->size >= size + footer_pad + header_pad + node_pad) {
         // There was a returned chunk, and that chunk has a dividend. (It's large enough to be divided.)
         header *dividend = (header *)((char *)found + header_pad + size + footer_pad);
         dividend->size = found->size - size - footer_pad - header_pad;
         dividend->in_use = false;
         header_to_footer(dividend)->size = dividend->size;
+        PROBE2(split, found, dividend->size);
         fake_root = add_chunk(fake_root, dividend, NULL);
+        note_free_added(dividend);
 
         found->size = size;
         header_to_footer(found)->size = size;
     }
     found->in_use = true;
+    found->slack = (unsigned short)(found->size - requested);
+    found->sample = 0;
+    found->tag = tag;
+    if(sample_period) {
+        if(requested >= bytes_until_sample) {
+            sample_allocation(found, requested);
+            bytes_until_sample = next_sample_interval();
+        } else {
+            bytes_until_sample -= requested;
+        }
+    }
+    note_allocated(found, requested);
+    if(stats_page) publish_stats();
+    PROBE2(alloc_return, header_to_node(found), requested);
     return (void *)header_to_node(found);
 }
 
-void trfree(void *to_free) {
+static void free_chunk(void *to_free) {
     header *to_free_chunk = node_to_header((node *)to_free);
     header *concat_candidate = NULL;
+    PROBE1(free, to_free);
+    note_freed(to_free_chunk);
+    if(to_free_chunk->sample) unsample_allocation(to_free_chunk);
     if(to_free_chunk != first_chunk) {
         // We are not the first chunk in memory, and thus the previous chunk exists.
         concat_candidate = footer_to_header((footer *)((char *)to_free_chunk - footer_pad));
         if(!(concat_candidate->in_use)) {
             // The previous chunk is free, so we can "sew" it together with this newly-freed chunk.
+            PROBE2(coalesce, to_free_chunk, concat_candidate);
             remove_chunk(concat_candidate);
+            note_free_removed(concat_candidate);
             concat_candidate->size += footer_pad + header_pad + to_free_chunk->size;
             header_to_footer(concat_candidate)->size = concat_candidate->size;
             // Need to reassign to_free_chunk to play nicely when we check to see if the next chunk is free, as well.
@@ -151,13 +428,268 @@ void trfree(void *to_free) {
         concat_candidate = (header *)((char *)header_to_footer(to_free_chunk) + footer_pad);
         if(!(concat_candidate->in_use)) {
             // The next chunk is free, so we can "sew" it together with this newly-freed chunk.
+            PROBE2(coalesce, to_free_chunk, concat_candidate);
             remove_chunk(concat_candidate);
+            note_free_removed(concat_candidate);
             to_free_chunk->size += footer_pad + header_pad + concat_candidate->size;
             header_to_footer(to_free_chunk)->size = to_free_chunk->size;
         }
     }
     to_free_chunk->in_use = false;
     fake_root = add_chunk(fake_root, to_free_chunk, NULL);
+    note_free_added(to_free_chunk);
+    if(stats_page) publish_stats();
+}
+
+void trstats(struct trstats *out) {
+    out->bytes_requested = requested_bytes;
+    out->bytes_in_use = in_use_bytes;
+    out->bytes_free = free_bytes;
+    out->free_chunks = free_chunks;
+    out->largest_free = largest_free;
+    out->heap_size = first_chunk ? (size_t)((char *)guard_addr - (char *)first_chunk) : 0;
+    // Every mmap is a diagnostic side table. Only sbrk grows the heap.
+    out->os_calls = syscalls.sbrk.calls;
+    out->fragmentation = free_bytes ? 1.0 - (double)largest_free / (double)free_bytes : 0.0;
+    out->allocs = total_allocs;
+    out->frees = total_frees;
+}
+
+int trstats_publish(const char *path) {
+    if(stats_page) {
+        os_unmap(stats_page, sizeof(struct trstats_page));
+        stats_page = NULL;
+    }
+    if(!path) return 0;
+    // No O_TRUNC. A file left by an earlier run is resized in place, so a watcher still mapping it never sees it short.
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return -1;
+    struct trstats_page *page = NULL;
+    if(!ftruncate(fd, sizeof(struct trstats_page))) page = (struct trstats_page *)os_map(sizeof(struct trstats_page), fd);
+    // The mapping keeps the file alive on its own.
+    close(fd);
+    if(!page) return -1;
+    // Whatever the old contents were, including a sequence left odd by a writer that died mid-update, reset them under an
+    // odd sequence and leave it even.
+    uint64_t sequence = page->sequence | 1;
+    __atomic_store_n(&page->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(page->magic, TRSTATS_PAGE_MAGIC, sizeof(page->magic));
+    page->version = TRSTATS_PAGE_VERSION;
+    page->pid = (uint32_t)getpid();
+    page->heap_size = 0;
+    page->bytes_requested = 0;
+    page->bytes_in_use = 0;
+    page->bytes_free = 0;
+    page->free_chunks = 0;
+    page->largest_free = 0;
+    page->allocs = 0;
+    page->frees = 0;
+    page->os_calls = 0;
+    page->fragmentation = 0.0;
+    __atomic_store_n(&page->sequence, sequence + 1, __ATOMIC_RELEASE);
+    stats_page = page;
+    publish_stats();
+    return 0;
+}
+
+static void publish_stats(void) {
+    struct trstats current;
+    trstats(&current);
+    // A seqlock. The fences keep the field stores between the two sequence bumps as far as a reader can tell.
+    uint64_t sequence = stats_page->sequence;
+    __atomic_store_n(&stats_page->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    stats_page->heap_size = current.heap_size;
+    stats_page->bytes_requested = current.bytes_requested;
+    stats_page->bytes_in_use = current.bytes_in_use;
+    stats_page->bytes_free = current.bytes_free;
+    stats_page->free_chunks = current.free_chunks;
+    stats_page->largest_free = current.largest_free;
+    stats_page->allocs = current.allocs;
+    stats_page->frees = current.frees;
+    stats_page->os_calls = current.os_calls;
+    stats_page->fragmentation = current.fragmentation;
+    __atomic_store_n(&stats_page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void trwaste(struct trwaste *out) {
+    out->requested_bytes = requested_bytes;
+    out->granted_bytes = in_use_bytes;
+    out->rounding_bytes = rounding_bytes;
+    out->min_size_bytes = min_size_bytes;
+    out->unsplit_bytes = unsplit_bytes;
+    out->overhead_bytes = live_chunks * (header_pad + footer_pad);
+    memcpy(out->requested_by_class, requested_by_class, sizeof(requested_by_class));
+    memcpy(out->granted_by_class, granted_by_class, sizeof(granted_by_class));
+}
+
+void trtag_stats(unsigned tag, struct trtag_stats *out) {
+    *out = tag_stats[tag < TR_TAG_OVERFLOW ? tag : TR_TAG_OVERFLOW];
+}
+
+void trsize_hist(struct trsize_hist *out) {
+    memcpy(out->allocs, alloc_counts, sizeof(alloc_counts));
+    memcpy(out->frees, free_counts, sizeof(free_counts));
+}
+
+int trsize_class(size_t size) { return log_linear_bucket(size, TR_SIZE_CLASS_BITS); }
+size_t trsize_class_min(int size_class) { return (size_t)log_linear_min(size_class, TR_SIZE_CLASS_BITS); }
+
+int trsize_hist_dump(int fd) {
+    writer w = { .fd = fd };
+    int i;
+    writer_printf(&w, "# min_size max_size allocs\n");
+    for(i = 0; i < (int)TR_SIZE_CLASSES; i++) {
+        if(!alloc_counts[i]) continue;
+        // The top class's successor wraps to 0, which makes its maximum SIZE_MAX, as it should be.
+        writer_printf(&w, "%zu %zu %zu\n", trsize_class_min(i), trsize_class_min(i + 1) - 1, alloc_counts[i]);
+    }
+    writer_flush(&w);
+    return w.error ? -1 : 0;
+}
+
+void trlatency_enable(int enable) {
+    latency_enabled = enable;
+    update_instrumented();
+}
+
+void trlatency(struct trlatency *alloc_out, struct trlatency *free_out) {
+    if(alloc_out) latency_summarize(&alloc_latency, alloc_out);
+    if(free_out) latency_summarize(&free_latency, free_out);
+}
+
+static inline void update_instrumented(void) { instrumented = latency_enabled || trace_fd >= 0 || slow_threshold_ns; }
+
+void trslow_threshold(uint64_t threshold_ns) {
+    if(threshold_ns && !slow_threshold_ns) warm_up_backtrace();
+    slow_threshold_ns = threshold_ns;
+    update_instrumented();
+}
+
+size_t trslow_read(struct trslow_event *out, size_t max, size_t *total) {
+    size_t held = slow_total < SLOW_EVENTS ? slow_total : SLOW_EVENTS;
+    size_t count = max < held ? max : held;
+    size_t i;
+    for(i = 0; i < count; i++) out[i] = slow_events[(slow_total - count + i) % SLOW_EVENTS];
+    if(total) *total = slow_total;
+    return count;
+}
+
+static void slow_record(uint32_t op, void *ptr, size_t size, uint64_t timestamp, uint64_t duration, bool grew_heap) {
+    struct trslow_event *event = &slow_events[slow_total++ % SLOW_EVENTS];
+    event->timestamp_ns = timestamp;
+    event->duration_ns = duration;
+    event->op = op;
+    event->tree_visits = (uint32_t)call_visits;
+    event->size = size;
+    event->ptr = ptr;
+    event->grew_heap = grew_heap;
+    event->depth = backtrace(event->frames, TRSLOW_MAX_DEPTH);
+}
+
+int trtrace_start(int fd) {
+    if(trace_fd >= 0) return -1;
+    if(!trace_events) {
+        void *buffer = os_map(TRACE_EVENTS * sizeof(struct trtrace_event), -1);
+        if(!buffer) return -1;
+        trace_events = (struct trtrace_event *)buffer;
+    }
+    struct trtrace_header trace_header = { .magic = TRTRACE_MAGIC, .start_ns = now_ns() };
+    if(write_all(fd, &trace_header, sizeof(trace_header))) return -1;
+    trace_start_ns = trace_header.start_ns;
+    trace_len = 0;
+    trace_error = false;
+    trace_fd = fd;
+    update_instrumented();
+    return 0;
+}
+
+int trtrace_stop(void) {
+    if(trace_fd < 0) return -1;
+    int result = trace_flush();
+    trace_fd = -1;
+    update_instrumented();
+    return result;
+}
+
+static void trace_record(uint8_t op, void *ptr, size_t size, uint64_t timestamp) {
+    if(!trace_thread) trace_thread = (uint32_t)syscall(SYS_gettid);
+    struct trtrace_event *event = &trace_events[trace_len++];
+    event->timestamp_ns = timestamp - trace_start_ns;
+    event->ptr = (uint64_t)(uintptr_t)ptr;
+    event->size = size;
+    event->thread = trace_thread;
+    event->op = op;
+    memset(event->reserved, 0, sizeof(event->reserved));
+    if(trace_len == TRACE_EVENTS) trace_flush();
+}
+
+static int trace_flush(void) {
+    if(write_all(trace_fd, trace_events, trace_len * sizeof(struct trtrace_event))) trace_error = true;
+    trace_len = 0;
+    return trace_error ? -1 : 0;
+}
+
+void trsyscalls(struct trsyscalls *out) { *out = syscalls; }
+
+static void *os_sbrk(size_t bytes) {
+    uint64_t start = now_ns();
+    void *result = sbrk(bytes);
+    syscalls.sbrk.ns += now_ns() - start;
+    syscalls.sbrk.calls++;
+    syscalls.sbrk.bytes += bytes;
+    PROBE2(heap_grow, result, bytes);
+    return result;
+}
+
+static void *os_map(size_t bytes, int fd) {
+    uint64_t start = now_ns();
+    int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED;
+    void *result = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+    syscalls.mmap.ns += now_ns() - start;
+    syscalls.mmap.calls++;
+    if(result == MAP_FAILED) return NULL;
+    syscalls.mmap.bytes += bytes;
+    return result;
+}
+
+static void os_unmap(void *addr, size_t bytes) {
+    uint64_t start = now_ns();
+    munmap(addr, bytes);
+    syscalls.munmap.ns += now_ns() - start;
+    syscalls.munmap.calls++;
+    syscalls.munmap.bytes += bytes;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void latency_record(latency_hist *hist, uint64_t ns) {
+    hist->counts[log_linear_bucket(ns, LATENCY_SUB_BITS)]++;
+    hist->total++;
+    if(ns > hist->max) hist->max = ns;
+}
+
+static void latency_summarize(latency_hist *hist, struct trlatency *out) {
+    // Ranks are 1-based. A rank of 0 only happens with an empty histogram, where every percentile is 0.
+    size_t ranks[3] = { (hist->total + 1) / 2, hist->total - hist->total / 100, hist->total - hist->total / 1000 };
+    uint64_t *percentiles[3] = { &out->p50_ns, &out->p99_ns, &out->p999_ns };
+    size_t seen = 0;
+    int bucket, p = 0;
+    for(p = 0; p < 3; p++) *percentiles[p] = 0;
+    for(bucket = 0, p = 0; bucket < LATENCY_BUCKETS && p < 3; bucket++) {
+        seen += hist->counts[bucket];
+        while(p < 3 && ranks[p] && seen >= ranks[p]) {
+            uint64_t upper = log_linear_min(bucket + 1, LATENCY_SUB_BITS) - 1;
+            *percentiles[p++] = upper < hist->max ? upper : hist->max;
+        }
+    }
+    out->count = hist->total;
+    out->max_ns = hist->max;
 }
 
 static header *add_chunk(header *tree, header *to_add, header *parent_chunk) {
@@ -170,6 +702,7 @@ static header *add_chunk(header *tree, header *to_add, header *parent_chunk) {
         to_add_node->parent = parent_chunk;
         return to_add;
     }
+    tree_visits++;
     if(to_add->size < tree->size) {
         tree_node->left = add_chunk(tree_node->left, to_add, tree);
     } else if(to_add->size > tree->size) {
@@ -184,6 +717,7 @@ static header *add_chunk(header *tree, header *to_add, header *parent_chunk) {
 
 static header *remove_chunk_by_size(header *tree, size_t size) {
     if(!tree) return NULL; // Didn't find a good node.
+    tree_visits++;
     node *tree_node = header_to_node(tree);
     if(tree->size < size) {
         return remove_chunk_by_size(tree_node->right, size);
@@ -202,6 +736,7 @@ static void remove_chunk(header *to_remove) {
     if(to_remove_node->left) {
         if(to_remove_node->right) {
             header *replacement = find_replacement(to_remove);
+            PROBE2(tree_replace, to_remove, replacement);
             node *replacement_node = header_to_node(replacement);
             remove_chunk(replacement);
             replacement_node->parent = to_remove_node->parent;
@@ -245,11 +780,595 @@ static header *find_smallest(header *tree) {
     else return find_smallest(tree_node->left);
 }
 
+int trsample_start(size_t period) {
+    if(period && !sample_stacks) {
+        void *table = os_map(SAMPLE_STACKS * sizeof(sample_stack), -1);
+        if(!table) return -1;
+        sample_stacks = (sample_stack *)table;
+        warm_up_backtrace();
+    }
+    sample_period = period;
+    if(period) {
+        last_sample_period = period;
+        bytes_until_sample = next_sample_interval();
+    }
+    return 0;
+}
+
+int trsample_dump(int fd) {
+    writer w = { .fd = fd };
+    size_t live_objs = 0, live_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+    int i, j;
+    for(i = 0; sample_stacks && i < SAMPLE_STACKS; i++) {
+        live_objs += sample_stacks[i].live_objs;
+        live_bytes += sample_stacks[i].live_bytes;
+        alloc_objs += sample_stacks[i].alloc_objs;
+        alloc_bytes += sample_stacks[i].alloc_bytes;
+    }
+    writer_printf(&w, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_objs, live_bytes, alloc_objs, alloc_bytes, last_sample_period);
+    for(i = 0; sample_stacks && i < SAMPLE_STACKS; i++) {
+        sample_stack *stack = &sample_stacks[i];
+        if(!stack->alloc_objs) continue;
+        writer_printf(&w, "%zu: %zu [%zu: %zu] @", stack->live_objs, stack->live_bytes, stack->alloc_objs, stack->alloc_bytes);
+        for(j = 0; j < stack->depth; j++) writer_printf(&w, " %p", stack->frames[j]);
+        writer_put(&w, "\n", 1);
+    }
+    // pprof needs the memory map to symbolize the addresses.
+    writer_printf(&w, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if(maps >= 0) {
+        ssize_t n;
+        writer_flush(&w);
+        while((n = read(maps, w.buf, sizeof(w.buf))) > 0) {
+            w.len = (size_t)n;
+            writer_flush(&w);
+        }
+        close(maps);
+    }
+    writer_flush(&w);
+    return w.error ? -1 : 0;
+}
+
+int trdump(int fd) {
+    writer w = { .fd = fd };
+    struct trdump_header dump_header = { .magic = TRDUMP_MAGIC };
+    dump_header.header_pad = header_pad;
+    dump_header.footer_pad = footer_pad;
+    dump_header.node_pad = node_pad;
+    dump_header.first_chunk = (uint64_t)(uintptr_t)first_chunk;
+    dump_header.guard_addr = (uint64_t)(uintptr_t)guard_addr;
+    dump_header.tree_root = fake_root ? (uint64_t)(uintptr_t)header_to_node(fake_root)->right : 0;
+    writer_put(&w, &dump_header, sizeof(dump_header));
+    header *cur;
+    for(cur = (header *)first_chunk; cur; cur = next_chunk(cur)) {
+        struct trdump_chunk record = { .addr = (uint64_t)(uintptr_t)cur, .size = cur->size };
+        record.in_use = cur->in_use;
+        if(cur->in_use) record.tag = cur->tag;
+        if(!cur->in_use) {
+            node *cur_node = header_to_node(cur);
+            record.parent = (uint64_t)(uintptr_t)cur_node->parent;
+            record.left = (uint64_t)(uintptr_t)cur_node->left;
+            record.right = (uint64_t)(uintptr_t)cur_node->right;
+        }
+        writer_put(&w, &record, sizeof(record));
+    }
+    writer_flush(&w);
+    return w.error ? -1 : 0;
+}
+
+int trheatmap(int fd, size_t bucket_size) {
+    if(!bucket_size || bucket_size & (bucket_size - 1)) return -1;
+    writer w = { .fd = fd };
+    heatmap h = { .w = &w, .bucket_size = bucket_size };
+    struct trheatmap_header heat_header = { .magic = TRHEATMAP_MAGIC, .bucket_size = bucket_size };
+    if(first_chunk) {
+        h.base = (uintptr_t)first_chunk & ~(uintptr_t)(bucket_size - 1);
+        heat_header.base = h.base;
+        heat_header.buckets = ((uintptr_t)guard_addr - h.base + bucket_size - 1) / bucket_size;
+    }
+    writer_put(&w, &heat_header, sizeof(heat_header));
+    header *cur;
+    for(cur = (header *)first_chunk; cur; cur = next_chunk(cur)) {
+        uintptr_t payload = (uintptr_t)header_to_node(cur);
+        heatmap_seek(&h, (uintptr_t)cur);
+        h.cur.chunks++;
+        // The first node_pad bytes of a free chunk hold its tree links, so they have to stay resident.
+        heatmap_span(&h, payload, payload + cur->size, cur->in_use, payload + node_pad, cur->in_use ? 0 : payload + cur->size);
+    }
+    if(first_chunk) {
+        heatmap_seek(&h, (uintptr_t)guard_addr - 1);
+        writer_put(&w, &h.cur, sizeof(h.cur));
+    }
+    writer_flush(&w);
+    return w.error ? -1 : 0;
+}
+
+static void heatmap_seek(heatmap *h, uintptr_t addr) {
+    size_t index = (addr - h->base) / h->bucket_size;
+    while(h->index < index) {
+        writer_put(h->w, &h->cur, sizeof(h->cur));
+        memset(&h->cur, 0, sizeof(h->cur));
+        h->index++;
+    }
+}
+
+static void heatmap_span(heatmap *h, uintptr_t start, uintptr_t end, bool live, uintptr_t release_start, uintptr_t release_end) {
+    while(start < end) {
+        heatmap_seek(h, start);
+        uintptr_t bucket_start = h->base + h->index * h->bucket_size;
+        uintptr_t bucket_end = bucket_start + h->bucket_size;
+        uintptr_t stop = end < bucket_end ? end : bucket_end;
+        if(live) h->cur.live_bytes += stop - start;
+        else h->cur.free_bytes += stop - start;
+        if(bucket_start >= release_start && bucket_end <= release_end) h->cur.releasable = 1;
+        start = stop;
+    }
+}
+
+struct trsnapshot *trsnapshot_take(void) {
+    size_t bytes = sizeof(struct trsnapshot) + live_chunks * sizeof(snapshot_entry);
+    struct trsnapshot *snapshot = (struct trsnapshot *)os_map(bytes, -1);
+    if(!snapshot) return NULL;
+    snapshot->mapped_bytes = bytes;
+    snapshot->count = 0;
+    header *cur;
+    for(cur = (header *)first_chunk; cur; cur = next_chunk(cur)) {
+        if(!cur->in_use) continue;
+        snapshot_entry *entry = &snapshot->entries[snapshot->count++];
+        entry->addr = (uintptr_t)header_to_node(cur);
+        entry->size = cur->size - cur->slack;
+        entry->tag = cur->tag;
+    }
+    return snapshot;
+}
+
+void trsnapshot_release(struct trsnapshot *snapshot) {
+    if(snapshot) os_unmap(snapshot, snapshot->mapped_bytes);
+}
+
+int trsnapshot_diff(const struct trsnapshot *before, const struct trsnapshot *after, trdiff_fn callback, void *ctx) {
+    size_t bytes = TR_TAGS * TR_SIZE_CLASSES * sizeof(struct trsnapshot_group);
+    struct trsnapshot_group *groups = (struct trsnapshot_group *)os_map(bytes, -1);
+    if(!groups) return -1;
+    // Snapshots are taken in address order, so one merge pass lines them up.
+    size_t i = 0, j = 0;
+    while(i < before->count || j < after->count) {
+        const snapshot_entry *old_entry = i < before->count ? &before->entries[i] : NULL;
+        const snapshot_entry *new_entry = j < after->count ? &after->entries[j] : NULL;
+        if(old_entry && new_entry && old_entry->addr == new_entry->addr) {
+            if(old_entry->size == new_entry->size && old_entry->tag == new_entry->tag) {
+                diff_count(groups, new_entry, DIFF_RETAINED);
+            } else {
+                diff_count(groups, old_entry, DIFF_FREED);
+                diff_count(groups, new_entry, DIFF_NEW);
+            }
+            i++;
+            j++;
+        } else if(!new_entry || (old_entry && old_entry->addr < new_entry->addr)) {
+            diff_count(groups, old_entry, DIFF_FREED);
+            i++;
+        } else {
+            diff_count(groups, new_entry, DIFF_NEW);
+            j++;
+        }
+    }
+    int result = 0;
+    size_t g;
+    for(g = 0; g < TR_TAGS * TR_SIZE_CLASSES && !result; g++) {
+        struct trsnapshot_group *group = &groups[g];
+        if(!group->new_allocs && !group->freed_allocs && !group->retained_allocs) continue;
+        group->tag = (unsigned)(g / TR_SIZE_CLASSES);
+        group->size_class = (int)(g % TR_SIZE_CLASSES);
+        result = callback(group, ctx);
+    }
+    os_unmap(groups, bytes);
+    return result;
+}
+
+static inline void diff_count(struct trsnapshot_group *groups, const snapshot_entry *entry, diff_kind kind) {
+    struct trsnapshot_group *group = &groups[entry->tag * TR_SIZE_CLASSES + trsize_class(entry->size)];
+    if(kind == DIFF_NEW) {
+        group->new_allocs++;
+        group->new_bytes += entry->size;
+    } else if(kind == DIFF_FREED) {
+        group->freed_allocs++;
+        group->freed_bytes += entry->size;
+    } else {
+        group->retained_allocs++;
+        group->retained_bytes += entry->size;
+    }
+}
+
+int trrss(struct trrss *out) {
+    memset(out, 0, sizeof(*out));
+    out->live_bytes = in_use_bytes;
+    out->free_bytes = free_bytes;
+    if(!first_chunk) return 0;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)first_chunk & ~(page - 1);
+    uintptr_t end = ((uintptr_t)guard_addr + page - 1) & ~(page - 1);
+    out->heap_bytes = end - start;
+    if(count_resident(start, end, &out->resident_bytes)) return -1;
+    header *cur;
+    for(cur = (header *)first_chunk; cur; cur = next_chunk(cur)) {
+        if(cur->in_use) continue;
+        // Only whole pages past the tree links and before the footer could be released.
+        uintptr_t release_start = ((uintptr_t)header_to_node(cur) + node_pad + page - 1) & ~(page - 1);
+        uintptr_t release_end = (uintptr_t)header_to_footer(cur) & ~(page - 1);
+        if(release_start < release_end && count_resident(release_start, release_end, &out->releasable_resident_bytes)) return -1;
+    }
+    out->mapping_dirty_bytes = count_mapping_dirty(start, end);
+    return 0;
+}
+
+static int count_resident(uintptr_t start, uintptr_t end, size_t *resident) {
+    // One byte per page. Going a window at a time keeps the vector on the stack however large the heap is.
+    unsigned char vec[4096];
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    while(start < end) {
+        size_t pages = (end - start) / page;
+        if(pages > sizeof(vec)) pages = sizeof(vec);
+        if(mincore((void *)start, pages * page, vec)) return -1;
+        size_t i;
+        for(i = 0; i < pages; i++) if(vec[i] & 1) *resident += page;
+        start += pages * page;
+    }
+    return 0;
+}
+
+static size_t count_mapping_dirty(uintptr_t start, uintptr_t end) {
+    int fd = open("/proc/self/smaps", O_RDONLY);
+    if(fd < 0) return 0;
+    char buf[4096];
+    size_t len = 0, dirty = 0;
+    bool overlaps = false;
+    ssize_t n;
+    while((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += (size_t)n;
+        buf[len] = '\0';
+        char *line = buf, *newline;
+        while((newline = strchr(line, '\n'))) {
+            *newline = '\0';
+            unsigned long low, high, kb;
+            // Mapping lines start with "low-high ". Field lines start with a name and a colon.
+            if(sscanf(line, "%lx-%lx ", &low, &high) == 2 && strchr(line, '-') < strchr(line, ' '))
+                overlaps = low < end && high > start;
+            else if(overlaps && (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1 || sscanf(line, "Shared_Dirty: %lu kB", &kb) == 1))
+                dirty += (size_t)kb * 1024;
+            line = newline + 1;
+        }
+        len = (size_t)(buf + len - line);
+        memmove(buf, line, len);
+        // A line longer than the buffer can only be a mapping's path, which we don't need.
+        if(len == sizeof(buf) - 1) len = 0;
+    }
+    close(fd);
+    return dirty;
+}
+
+int trcheck(void) {
+    size_t heap_free_chunks = 0, heap_free_bytes = 0, heap_in_use_bytes = 0;
+    bool prev_free = false;
+    header *cur;
+    for(cur = (header *)first_chunk; cur; cur = next_chunk(cur)) {
+        if(cur->size % sizeof(intptr_t) || cur->size < node_pad) return TRCHECK_BAD_SIZE;
+        if((char *)cur + header_pad + cur->size + footer_pad > (char *)guard_addr) return TRCHECK_BAD_ADDRESS;
+        if(header_to_footer(cur)->size != cur->size) return TRCHECK_FOOTER_MISMATCH;
+        if(cur->in_use) {
+            heap_in_use_bytes += cur->size;
+            prev_free = false;
+        } else {
+            if(prev_free) return TRCHECK_ADJACENT_FREE;
+            heap_free_chunks++;
+            heap_free_bytes += cur->size;
+            prev_free = true;
+        }
+    }
+    if(heap_free_chunks != free_chunks || heap_free_bytes != free_bytes || heap_in_use_bytes != in_use_bytes)
+        return TRCHECK_STATS_MISMATCH;
+    if(!fake_root) return heap_free_chunks ? TRCHECK_TREE_COUNT : TRCHECK_OK;
+    if(header_to_node(fake_root)->left) return TRCHECK_TREE_ORDER;
+
+    // In-order walk using the parent links instead of a stack, so a degenerate tree can't overflow anything.
+    // Any cycle or shared subtree breaks a parent link or pushes the count past the number of free chunks.
+    size_t tree_chunks = 0, prev_size = 0;
+    int result;
+    header *parent = fake_root;
+    cur = header_to_node(fake_root)->right;
+    if(!cur) return heap_free_chunks ? TRCHECK_TREE_COUNT : TRCHECK_OK;
+    if((result = check_tree_link(cur, parent))) return result;
+    while(true) {
+        // Descend to the smallest chunk of the current subtree.
+        header *left;
+        while((left = header_to_node(cur)->left)) {
+            if((result = check_tree_link(left, cur))) return result;
+            cur = left;
+        }
+        while(true) {
+            if(++tree_chunks > heap_free_chunks) return TRCHECK_TREE_COUNT;
+            if(cur->size < prev_size) return TRCHECK_TREE_ORDER;
+            prev_size = cur->size;
+            header *right = header_to_node(cur)->right;
+            if(right) {
+                if((result = check_tree_link(right, cur))) return result;
+                cur = right;
+                break;
+            }
+            // Climb until we come up out of a left subtree. That parent is next in order.
+            parent = header_to_node(cur)->parent;
+            while(parent != fake_root && header_to_node(parent)->right == cur) {
+                cur = parent;
+                parent = header_to_node(cur)->parent;
+            }
+            if(parent == fake_root) return tree_chunks == heap_free_chunks ? TRCHECK_OK : TRCHECK_TREE_COUNT;
+            cur = parent;
+        }
+    }
+}
+
+static int check_tree_link(header *child, header *parent) {
+    char *addr = (char *)child;
+    if(addr < (char *)first_chunk || addr + header_pad + node_pad + footer_pad > (char *)guard_addr
+            || (addr - (char *)first_chunk) % sizeof(intptr_t))
+        return TRCHECK_BAD_ADDRESS;
+    if(child->size % sizeof(intptr_t) || child->size < node_pad) return TRCHECK_BAD_SIZE;
+    if(addr + header_pad + child->size + footer_pad > (char *)guard_addr) return TRCHECK_BAD_ADDRESS;
+    // A footer that matches is the best evidence we have that this is really the start of a chunk.
+    if(header_to_footer(child)->size != child->size) return TRCHECK_BAD_ADDRESS;
+    if(child->in_use) return TRCHECK_TREE_NODE_IN_USE;
+    if(header_to_node(child)->parent != parent) return TRCHECK_PARENT_LINK;
+    return TRCHECK_OK;
+}
+
+void trtree_stats(struct trtree_stats *out) {
+    out->add_ops = add_ops;
+    out->add_visits = add_visits;
+    out->add_max_visits = add_max_visits;
+    out->search_ops = search_ops;
+    out->search_visits = search_visits;
+    out->search_max_visits = search_max_visits;
+    out->max_height = max_tree_height;
+    out->height = 0;
+    out->nodes = 0;
+    out->leaves = 0;
+    out->one_child = 0;
+    out->average_depth = 0.0;
+    header *cur = fake_root ? header_to_node(fake_root)->right : NULL;
+    if(!cur) return;
+
+    // Preorder walk on the parent links, so a degenerate tree costs no stack.
+    size_t depth = 1, depth_sum = 0;
+    while(true) {
+        node *cur_node = header_to_node(cur);
+        out->nodes++;
+        depth_sum += depth;
+        if(depth > out->height) out->height = depth;
+        if(!cur_node->left && !cur_node->right) out->leaves++;
+        else if(!cur_node->left || !cur_node->right) out->one_child++;
+        if(cur_node->left || cur_node->right) {
+            cur = cur_node->left ? cur_node->left : cur_node->right;
+            depth++;
+            continue;
+        }
+        // Climb until we find a right subtree we haven't been down yet.
+        header *parent = cur_node->parent;
+        while(parent != fake_root && (header_to_node(parent)->right == cur || !header_to_node(parent)->right)) {
+            cur = parent;
+            parent = header_to_node(cur)->parent;
+            depth--;
+        }
+        if(parent == fake_root) break;
+        cur = header_to_node(parent)->right;
+    }
+    out->average_depth = (double)depth_sum / (double)out->nodes;
+}
+
+static void warm_up_backtrace(void) {
+    void *frames[1];
+    backtrace(frames, 1);
+}
+
+static void sample_allocation(header *chunk, size_t requested) {
+    void *frames[SAMPLE_MAX_DEPTH];
+    int depth = backtrace(frames, SAMPLE_MAX_DEPTH);
+    int i;
+    // Drop the frames inside tralloc. If the caller is somehow missing, keep the whole stack rather than lose the sample.
+    int skip = 0;
+    for(i = 0; i < depth; i++) {
+        if(frames[i] == sample_caller) {
+            skip = i;
+            break;
+        }
+    }
+    depth -= skip;
+    memmove(frames, frames + skip, depth * sizeof(void *));
+    // FNV-1a over the return addresses.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(i = 0; i < depth; i++) hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001b3ULL;
+    size_t slot = (size_t)hash & (SAMPLE_STACKS - 1);
+    size_t probes;
+    for(probes = 0; probes < SAMPLE_STACKS; probes++, slot = (slot + 1) & (SAMPLE_STACKS - 1)) {
+        sample_stack *stack = &sample_stacks[slot];
+        if(!stack->depth) {
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(void *));
+        } else if(stack->hash != hash || stack->depth != depth || memcmp(stack->frames, frames, depth * sizeof(void *))) {
+            continue;
+        }
+        stack->live_objs++;
+        stack->live_bytes += requested;
+        stack->alloc_objs++;
+        stack->alloc_bytes += requested;
+        chunk->sample = (unsigned int)slot + 1;
+        return;
+    }
+    // The table is full of other stacks. Drop the sample rather than grow while inside tralloc.
+}
+
+static void unsample_allocation(header *chunk) {
+    sample_stack *stack = &sample_stacks[chunk->sample - 1];
+    stack->live_objs--;
+    stack->live_bytes -= chunk->size - chunk->slack;
+    chunk->sample = 0;
+}
+
+static size_t next_sample_interval(void) {
+    // Exponentially distributed with a mean of sample_period, which makes sampling a Poisson process over the bytes allocated.
+    // That is what pprof assumes when it scales heap_v2 samples back up.
+    sample_rng ^= sample_rng << 13;
+    sample_rng ^= sample_rng >> 7;
+    sample_rng ^= sample_rng << 17;
+    uint64_t r = (sample_rng >> 33) + 1;
+    // -ln(r / 2^31) = ln(2) * (31 - log2(r)). log2 of the mantissa uses a quadratic fit, which is close enough for a sampling interval.
+    int log = floor_log2(r);
+    double mantissa = (double)r / (double)((uint64_t)1 << log) - 1.0;
+    double log2_r = log + mantissa * (1.3465 - 0.3465 * mantissa);
+    return (size_t)((31.0 - log2_r) * 0.6931471805599453 * (double)sample_period) + 1;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    while(len) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) return -1;
+        data = (const char *)data + n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void writer_flush(writer *w) {
+    if(!w->error && write_all(w->fd, w->buf, w->len)) w->error = 1;
+    w->len = 0;
+}
+
+static void writer_put(writer *w, const void *data, size_t len) {
+    while(len) {
+        size_t n = sizeof(w->buf) - w->len;
+        if(n > len) n = len;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data = (const char *)data + n;
+        len -= n;
+        if(w->len == sizeof(w->buf)) writer_flush(w);
+    }
+}
+
+static void writer_printf(writer *w, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if(n > 0) writer_put(w, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+static inline void note_allocated(header *chunk, size_t requested) {
+    requested_bytes += requested;
+    in_use_bytes += chunk->size;
+    live_chunks++;
+    total_allocs++;
+    struct trtag_stats *tagged = &tag_stats[chunk->tag];
+    tagged->live_bytes += chunk->size;
+    tagged->live_allocs++;
+    tagged->allocs++;
+    if(tagged->live_bytes > tagged->peak_bytes) tagged->peak_bytes = tagged->live_bytes;
+    int size_class = trsize_class(requested);
+    alloc_counts[size_class]++;
+    note_waste(requested, chunk->size, size_class, true);
+}
+
+static inline void note_freed(header *chunk) {
+    size_t requested = chunk->size - chunk->slack;
+    requested_bytes -= requested;
+    in_use_bytes -= chunk->size;
+    live_chunks--;
+    total_frees++;
+    tag_stats[chunk->tag].live_bytes -= chunk->size;
+    tag_stats[chunk->tag].live_allocs--;
+    int size_class = trsize_class(requested);
+    free_counts[size_class]++;
+    note_waste(requested, chunk->size, size_class, false);
+}
+
+static inline void note_waste(size_t requested, size_t granted, int size_class, bool add) {
+    // Replays tralloc's sizing so the split by cause can be recovered at free time from the chunk alone.
+    size_t rounded = ceil_size(requested, sizeof(intptr_t));
+    size_t minimum = rounded < node_pad ? node_pad : rounded;
+    if(add) {
+        rounding_bytes += rounded - requested;
+        min_size_bytes += minimum - rounded;
+        unsplit_bytes += granted - minimum;
+        requested_by_class[size_class] += requested;
+        granted_by_class[size_class] += granted;
+    } else {
+        rounding_bytes -= rounded - requested;
+        min_size_bytes -= minimum - rounded;
+        unsplit_bytes -= granted - minimum;
+        requested_by_class[size_class] -= requested;
+        granted_by_class[size_class] -= granted;
+    }
+}
+
+static inline void note_free_added(header *chunk) {
+    // The new chunk hangs one level below every real node we visited.
+    size_t depth = note_tree_op(&add_ops, &add_visits, &add_max_visits) + 1;
+    if(depth > max_tree_height) max_tree_height = depth;
+    free_bytes += chunk->size;
+    free_chunks++;
+    if(chunk->size > largest_free) largest_free = chunk->size;
+}
+
+static inline void note_free_removed(header *chunk) {
+    free_bytes -= chunk->size;
+    free_chunks--;
+    // Only a walk down the right spine can tell us the new largest chunk, and we only need it if we just took the largest.
+    // The fake root has size 0, so an empty tree yields 0.
+    if(chunk->size == largest_free) largest_free = find_largest(fake_root)->size;
+}
+
+static inline header *next_chunk(header *chunk) {
+    char *next = (char *)header_to_footer(chunk) + footer_pad;
+    return next == (char *)guard_addr ? NULL : (header *)next;
+}
+
+static inline size_t note_tree_op(size_t *ops, size_t *visits, size_t *max_visits) {
+    // Every walk starts at fake_root, which isn't a real node.
+    size_t real = tree_visits - 1;
+    (*ops)++;
+    *visits += real;
+    if(real > *max_visits) *max_visits = real;
+    call_visits += real;
+    tree_visits = 0;
+    return real;
+}
+
 static inline size_t ceil_size(size_t input, size_t offset) {
     if(input % offset) return input - (input % offset) + offset;
     return input;
 }
 
+static inline int floor_log2(uint64_t input) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(input);
+#else
+    int log = 0;
+    while(input >>= 1) log++;
+    return log;
+#endif
+}
+
+static inline int log_linear_bucket(uint64_t value, int sub_bits) {
+    if(value < ((uint64_t)1 << sub_bits)) return (int)value;
+    int log = floor_log2(value);
+    return ((log - sub_bits + 1) << sub_bits) + (int)((value >> (log - sub_bits)) & (((uint64_t)1 << sub_bits) - 1));
+}
+
+static inline uint64_t log_linear_min(int bucket, int sub_bits) {
+    if(bucket < (1 << sub_bits)) return (uint64_t)bucket;
+    return ((uint64_t)(1 << sub_bits) + (bucket & ((1 << sub_bits) - 1))) << ((bucket >> sub_bits) - 1);
+}
+
 static inline node *header_to_node(header *input) { return (node *)((char *)input + header_pad); }
 static inline footer *header_to_footer(header *input) { return (footer *)((char *)input + header_pad + input->size); }
 static inline header *node_to_header(node *input) { return (header *)((char *)input - header_pad); }
@@ -266,29 +1385,37 @@ void traudit(FILE *f) {
     fprintf(f, "footer_pad: %lu\n", footer_pad);
     fprintf(f, "node_pad: %lu\n", node_pad);
     if(!(first_chunk && guard_addr)) goto traudit_end;
-    header *cur = (header *)first_chunk;
-    node *cur_node = header_to_node(cur);
+    trheap_walk(fprint_chunk, f);
+    fprint_tree(f, fake_root, 0);
+    traudit_end: fprintf(f, "traudit end\n");
+}
+
+int trheap_walk(trwalk_fn callback, void *ctx) {
+    header *cur;
+    int result;
+    for(cur = (header *)first_chunk; cur; cur = next_chunk(cur)) {
+        if((result = callback(header_to_node(cur), cur->size, cur->in_use, ctx))) return result;
+    }
+    return 0;
+}
+
+static int fprint_chunk(void *ptr, size_t usable_size, int in_use, void *ctx) {
+    FILE *f = (FILE *)ctx;
+    node *cur_node = (node *)ptr;
+    header *cur = node_to_header(cur_node);
     footer *cur_footer = header_to_footer(cur);
-    while(true) {
-        fprintf(f, "    chunk: %p\n    chunk->size: %lu\n    chunk->in_use: %u\n", cur, cur->size, cur->in_use);
-        if(cur->in_use) {
-            int *i;
-            for(i = (int *)cur_node; (footer *)i != cur_footer; i++) {
-                fprintf(f, "        data: %x\n", *i);
-            }
-        } else {
-            // Should be in the free tree
-            fprintf(f, "    chunk_node->parent: %p\n    chunk_node->left: %p\n    chunk_node->right: %p\n", cur_node->parent, cur_node->left, cur_node->right);
+    fprintf(f, "    chunk: %p\n    chunk->size: %lu\n    chunk->in_use: %u\n", cur, usable_size, in_use);
+    if(in_use) {
+        int *i;
+        for(i = (int *)cur_node; (footer *)i != cur_footer; i++) {
+            fprintf(f, "        data: %x\n", *i);
         }
-        fprintf(f, "    chunk_footer->size: %lu\n", cur->size);
-        if((char *)header_to_footer(cur) + footer_pad == guard_addr)
-            break;
-        cur = (header *)((char *)cur_footer + footer_pad);
-        cur_node = header_to_node(cur);
-        cur_footer = header_to_footer(cur);
+    } else {
+        // Should be in the free tree
+        fprintf(f, "    chunk_node->parent: %p\n    chunk_node->left: %p\n    chunk_node->right: %p\n", cur_node->parent, cur_node->left, cur_node->right);
     }
-    fprint_tree(f, fake_root, 0);
-    traudit_end: fprintf(f, "traudit end\n");
+    fprintf(f, "    chunk_footer->size: %lu\n", cur_footer->size);
+    return 0;
 }
 
 static void fprint_tree(FILE *f, header *tree, int depth) {
@@ -28,15 +28,394 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/*
+ * When built against <sys/sdt.h>, tralloc carries USDT probes under the provider "tralloc". They cost a nop until a
+ * tracer such as bpftrace or SystemTap attaches:
+ *     alloc_entry(size), alloc_return(ptr, size), free(ptr),
+ *     heap_grow(addr, bytes), split(chunk, remainder_bytes), coalesce(chunk, neighbor),
+ *     tree_replace(removed, replacement).
+ * Define TRALLOC_NO_USDT to leave them out.
+ */
+
 void *tralloc(size_t size);
 
+// Tags attribute memory to whoever allocated it. tralloc uses tag 0. The last tag is reserved: any tag past it is
+// charged to TR_TAG_OVERFLOW, so memory with a bad tag shows up there instead of under some other caller's tag.
+#define TR_TAGS 256
+#define TR_TAG_OVERFLOW (TR_TAGS - 1)
+
+// Same as tralloc, but charges the allocation to tag, which should be below TR_TAG_OVERFLOW.
+void *tralloc_tagged(size_t size, unsigned tag);
+
 /*
  * to_free must be a pointer returned by tralloc and not freed once already.
  * Otherwise, undefined behavior will occur.
  */
 void trfree(void *to_free);
 
+// Called by trheap_walk for each chunk. ptr is the chunk's payload, which for a live chunk is what tralloc returned.
+// Return non-zero to stop the walk.
+typedef int (*trwalk_fn)(void *ptr, size_t usable_size, int in_use, void *ctx);
+
+// Visits every chunk in address order without printing or allocating. Returns whatever non-zero value stopped the walk,
+// or 0 once every chunk has been visited. The callback must not call tralloc or trfree.
+int trheap_walk(trwalk_fn callback, void *ctx);
+
 // Mostly provided for debugging purposes. Will print all chunks (in memory order) and the tree structure.
-void traudit(FILE *f);
\ No newline at end of file
+void traudit(FILE *f);
+
+struct trstats {
+    // Bytes callers asked for, summed over all live allocations.
+    size_t bytes_requested;
+    // Usable bytes of all live chunks. Never less than bytes_requested.
+    size_t bytes_in_use;
+    // Usable bytes of all chunks in the free tree.
+    size_t bytes_free;
+    size_t free_chunks;
+    size_t largest_free;
+    // Bytes from the first chunk to the end of the heap, headers and footers included.
+    size_t heap_size;
+    // Number of times the allocator asked the OS for heap memory. Mappings made for tralloc's own diagnostics, such as
+    // snapshots and profiler tables, are counted in trsyscalls instead.
+    size_t os_calls;
+    // 1 - largest_free / bytes_free. 0 means all free memory sits in one chunk.
+    double fragmentation;
+    // Calls to tralloc and trfree since the process started.
+    size_t allocs;
+    size_t frees;
+};
+
+// Fills out with the allocator's current statistics. The counters are kept up to date by tralloc and trfree, so this is O(1).
+void trstats(struct trstats *out);
+
+// Sizes are bucketed by power of two, and each power of two is split into TR_SIZE_CLASS_SUBS linear sub-buckets.
+// Sizes below TR_SIZE_CLASS_SUBS get a class each.
+#define TR_SIZE_CLASS_BITS 2
+#define TR_SIZE_CLASS_SUBS (1 << TR_SIZE_CLASS_BITS)
+#define TR_SIZE_CLASSES (TR_SIZE_CLASS_SUBS * (sizeof(size_t) * 8 - 1))
+
+struct trsize_hist {
+    // Counts by size class of the size passed to tralloc.
+    size_t allocs[TR_SIZE_CLASSES];
+    size_t frees[TR_SIZE_CLASSES];
+};
+
+void trsize_hist(struct trsize_hist *out);
+int trsize_class(size_t size);
+// Smallest size that falls in the given class.
+size_t trsize_class_min(int size_class);
+// Writes the allocation histogram to fd as text, one "min_size max_size allocs" line per non-empty class, after a
+// comment line starting with #. bench/trworkload reads this format to reproduce a size mix without a trace.
+// Returns 0 on success, or -1 on a write error.
+int trsize_hist_dump(int fd);
+
+// Sampling heap profiler. Once started, roughly one allocation per period bytes handed out has its call stack recorded
+// until it is passed to trfree. A period of 0 stops sampling; objects already sampled are still tracked until freed.
+// Returns 0 on success, or -1 if the sample tables could not be mapped.
+int trsample_start(size_t period);
+
+// Writes the sampled live heap and cumulative allocations to fd in the legacy heap profile format read by pprof.
+// Returns 0 on success, or -1 on a write error.
+int trsample_dump(int fd);
+
+// Binary heap dump. A trdump_header is followed by one trdump_chunk per chunk in address order, up to end of file.
+// All fields are in host byte order. Addresses are raw pointers in the dumped process.
+#define TRDUMP_MAGIC "TRDUMP1"
+
+struct trdump_header {
+    char magic[8];
+    uint64_t header_pad;
+    uint64_t footer_pad;
+    uint64_t node_pad;
+    uint64_t first_chunk;
+    uint64_t guard_addr;
+    // Root of the free tree, 0 if the tree is empty.
+    uint64_t tree_root;
+};
+
+struct trdump_chunk {
+    uint64_t addr;
+    uint64_t size;
+    // Tree links, only set for free chunks. The root's parent is the allocator's internal fake root.
+    uint64_t parent;
+    uint64_t left;
+    uint64_t right;
+    uint32_t in_use;
+    // The tag of a live chunk, 0 for free chunks.
+    uint32_t tag;
+};
+
+// Streams the heap to fd as a binary dump without allocating. Returns 0 on success, or -1 on a write error.
+// tools/trdump_analyze reads the result.
+int trdump(int fd);
+
+enum trcheck_result {
+    TRCHECK_OK = 0,
+    // A chunk or tree link points outside the heap or off a chunk boundary.
+    TRCHECK_BAD_ADDRESS,
+    // A chunk's size is misaligned or too small to have come from tralloc.
+    TRCHECK_BAD_SIZE,
+    TRCHECK_FOOTER_MISMATCH,
+    // Two free chunks are next to each other and should have been coalesced.
+    TRCHECK_ADJACENT_FREE,
+    TRCHECK_TREE_NODE_IN_USE,
+    // A child's parent link does not point back at the node that holds it.
+    TRCHECK_PARENT_LINK,
+    // The free tree's in-order walk is not sorted by size.
+    TRCHECK_TREE_ORDER,
+    // The free tree does not hold every free chunk exactly once.
+    TRCHECK_TREE_COUNT,
+    // The counters behind trstats disagree with the heap.
+    TRCHECK_STATS_MISMATCH
+};
+
+// Walks the heap and the free tree and verifies their invariants. Prints nothing.
+// Returns TRCHECK_OK, or the first problem found. O(n) in the number of chunks and uses constant stack.
+int trcheck(void);
+
+struct trtree_stats {
+    // Nodes visited while inserting into and searching the free tree, in total and for the worst single call.
+    size_t add_ops;
+    size_t add_visits;
+    size_t add_max_visits;
+    size_t search_ops;
+    size_t search_visits;
+    size_t search_max_visits;
+    // Tallest the tree has ever been. Height only grows on insertion, so this is exact.
+    size_t max_height;
+    // The rest describe the tree as it is now.
+    size_t height;
+    size_t nodes;
+    size_t leaves;
+    size_t one_child;
+    double average_depth;
+};
+
+// Fills out with free tree telemetry. The shape of the current tree is found by walking it, so this is O(n) in the number
+// of free chunks.
+void trtree_stats(struct trtree_stats *out);
+
+struct trlatency {
+    size_t count;
+    // Percentiles are the upper edge of the histogram bucket they fall in, which is within about 3% of the true value.
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+
+// Pass non-zero to time every tralloc and trfree call with CLOCK_MONOTONIC. Off by default.
+void trlatency_enable(int enable);
+// Either pointer may be NULL.
+void trlatency(struct trlatency *alloc_out, struct trlatency *free_out);
+
+// Binary allocation trace. A trtrace_header is followed by trtrace_events in call order, up to end of file.
+// All fields are in host byte order.
+#define TRTRACE_MAGIC "TRTRACE"
+#define TRTRACE_ALLOC 1
+#define TRTRACE_FREE 2
+
+struct trtrace_header {
+    char magic[8];
+    // CLOCK_MONOTONIC time the trace started. Event timestamps count from here.
+    uint64_t start_ns;
+};
+
+struct trtrace_event {
+    uint64_t timestamp_ns;
+    // The address tralloc returned. Addresses are reused after a free, so an id is only unique between its alloc and free.
+    uint64_t ptr;
+    // Size passed to tralloc. 0 for frees.
+    uint64_t size;
+    uint32_t thread;
+    uint8_t op;
+    uint8_t reserved[3];
+};
+
+// Starts logging every tralloc and trfree call to fd. Events are buffered and written whenever the buffer fills.
+// Returns 0 on success, or -1 if tracing is already on, the buffer could not be mapped or the header could not be written.
+int trtrace_start(int fd);
+// Writes out buffered events and stops tracing. Returns 0 on success, or -1 if any write failed. Does not close fd.
+int trtrace_stop(void);
+
+// Address-space heatmap. A trheatmap_header is followed by one trheatmap_bucket per bucket_size bytes of address space,
+// starting at base, which is the first chunk rounded down to bucket_size. All fields are in host byte order.
+#define TRHEATMAP_MAGIC "TRHEAT1"
+
+struct trheatmap_header {
+    char magic[8];
+    uint64_t base;
+    uint64_t bucket_size;
+    uint64_t buckets;
+};
+
+struct trheatmap_bucket {
+    // Payload bytes of live and free chunks within the bucket. Whatever is left of the bucket is headers and footers, or
+    // lies outside the heap.
+    uint64_t live_bytes;
+    uint64_t free_bytes;
+    // Chunks whose header starts in the bucket.
+    uint32_t chunks;
+    // 1 if the whole bucket lies in free memory that isn't holding a tree node, so its pages could be given back to the OS.
+    uint32_t releasable;
+};
+
+// Streams a heatmap of the heap to fd without allocating. bucket_size must be a power of two, usually the page size or
+// 64 KiB. Returns 0 on success, or -1 on a write error or a bad bucket_size.
+int trheatmap(int fd, size_t bucket_size);
+
+struct trsyscall_stat {
+    size_t calls;
+    // Bytes obtained from the OS, or for munmap and madvise, handed back.
+    size_t bytes;
+    uint64_t ns;
+};
+
+struct trsyscalls {
+    // Heap growth. Today that is one call per allocation the free tree can't satisfy.
+    struct trsyscall_stat sbrk;
+    // Side tables for the profiler and the trace recorder, the published stats page, snapshots and trsnapshot_diff's scratch.
+    struct trsyscall_stat mmap;
+    // The published stats page, released snapshots and trsnapshot_diff's scratch. tralloc never returns heap memory yet, so
+    // madvise stays 0.
+    struct trsyscall_stat munmap;
+    struct trsyscall_stat madvise;
+};
+
+// Fills out with every OS memory call tralloc has made, with its bytes and the time spent in it.
+void trsyscalls(struct trsyscalls *out);
+
+struct trwaste {
+    // Live allocations only. granted_bytes - requested_bytes is split into the three causes below.
+    size_t requested_bytes;
+    size_t granted_bytes;
+    // Requests rounded up to a multiple of the word size.
+    size_t rounding_bytes;
+    // Requests raised to the minimum chunk size, which must fit a free tree node.
+    size_t min_size_bytes;
+    // Free chunks handed out whole because the remainder was too small to split off.
+    size_t unsplit_bytes;
+    // Headers and footers of live chunks.
+    size_t overhead_bytes;
+    // Indexed by the size class of the request.
+    size_t requested_by_class[TR_SIZE_CLASSES];
+    size_t granted_by_class[TR_SIZE_CLASSES];
+};
+
+// Fills out with the internal fragmentation of the live heap.
+void trwaste(struct trwaste *out);
+
+#define TRSLOW_MAX_DEPTH 16
+
+struct trslow_event {
+    // CLOCK_MONOTONIC time the call started.
+    uint64_t timestamp_ns;
+    uint64_t duration_ns;
+    // TRTRACE_ALLOC or TRTRACE_FREE.
+    uint32_t op;
+    // Free tree nodes the call visited.
+    uint32_t tree_visits;
+    // Size passed to tralloc. 0 for frees.
+    uint64_t size;
+    void *ptr;
+    int grew_heap;
+    int depth;
+    void *frames[TRSLOW_MAX_DEPTH];
+};
+
+// Records any tralloc or trfree call that takes at least threshold_ns, with a backtrace, into a small ring buffer.
+// 0 turns it off, which is the default.
+void trslow_threshold(uint64_t threshold_ns);
+// Copies up to max of the most recent slow calls into out, oldest first, and returns how many were copied.
+// If total is not NULL it receives the number of slow calls seen since the threshold was first set, including overwritten ones.
+size_t trslow_read(struct trslow_event *out, size_t max, size_t *total);
+
+// Layout of the file written by trstats_publish. An agent maps the file read-only and polls it.
+#define TRSTATS_PAGE_MAGIC "TRSTATS"
+#define TRSTATS_PAGE_VERSION 1
+
+struct trstats_page {
+    char magic[8];
+    uint32_t version;
+    uint32_t pid;
+    // Odd while the process is updating the page. A reader copies the fields and retries unless it saw the same even value
+    // before and after the copy.
+    uint64_t sequence;
+    uint64_t heap_size;
+    uint64_t bytes_requested;
+    uint64_t bytes_in_use;
+    uint64_t bytes_free;
+    uint64_t free_chunks;
+    uint64_t largest_free;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t os_calls;
+    double fragmentation;
+};
+
+// Creates path, or reuses it in place, maps it shared and refreshes it from then on at the end of every tralloc and trfree,
+// so an external process can watch the allocator without calling into it. tools/trstats_watch is such a reader.
+// Passing NULL stops publishing and unmaps the page. Returns 0 on success, or -1 if the file could not be set up.
+int trstats_publish(const char *path);
+
+struct trrss {
+    // Pages spanned by the heap, from the page holding the first chunk to the one holding guard_addr.
+    size_t heap_bytes;
+    // Heap pages resident in memory, from mincore.
+    size_t resident_bytes;
+    // Resident pages lying wholly in free memory that doesn't hold a tree node, which purging could give back.
+    size_t releasable_resident_bytes;
+    // Private_Dirty plus Shared_Dirty of every mapping in /proc/self/smaps that overlaps the heap. These mappings can also
+    // hold memory that isn't tralloc's, such as other users of the program break.
+    size_t mapping_dirty_bytes;
+    // Logical sizes, as in trstats.
+    size_t live_bytes;
+    size_t free_bytes;
+};
+
+// Fills out with how much of the heap is actually in memory. Walks the heap and reads /proc/self/smaps without allocating.
+// Returns 0 on success, or -1 if mincore failed. mapping_dirty_bytes is left at 0 if smaps can't be read.
+int trrss(struct trrss *out);
+
+struct trtag_stats {
+    // Usable bytes and count of live allocations with the tag.
+    size_t live_bytes;
+    size_t live_allocs;
+    // Most live_bytes has ever been.
+    size_t peak_bytes;
+    // Allocations with the tag since the process started.
+    size_t allocs;
+};
+
+// Tags past TR_TAG_OVERFLOW read TR_TAG_OVERFLOW's stats, since that is where they were charged.
+void trtag_stats(unsigned tag, struct trtag_stats *out);
+
+// A lightweight copy of the live heap: the address, requested size and tag of every live allocation.
+struct trsnapshot;
+
+// Changes between two snapshots for one tag and request size class. An allocation counts as retained if both snapshots
+// have one at the same address with the same size and tag, so one freed and replaced by an identical twin reads as retained.
+struct trsnapshot_group {
+    unsigned tag;
+    int size_class;
+    size_t new_allocs;
+    size_t new_bytes;
+    size_t freed_allocs;
+    size_t freed_bytes;
+    size_t retained_allocs;
+    size_t retained_bytes;
+};
+
+// Return non-zero to stop the diff.
+typedef int (*trdiff_fn)(const struct trsnapshot_group *group, void *ctx);
+
+// Takes a snapshot in memory mapped from the OS, so the heap is left untouched. Returns NULL if it could not be mapped.
+struct trsnapshot *trsnapshot_take(void);
+void trsnapshot_release(struct trsnapshot *snapshot);
+// Calls callback once for every group that has any allocations in either snapshot, ordered by tag then size class.
+// Returns whatever non-zero value stopped the diff, 0 once every group has been reported, or -1 if scratch space for the
+// groups could not be mapped.
+int trsnapshot_diff(const struct trsnapshot *before, const struct trsnapshot *after, trdiff_fn callback, void *ctx);